@@ -0,0 +1,500 @@
+/*
+ * Author  : Jakub Šoustar <jakub.soustar@gmail.com> <xsoust02@stud.fit.vutbr.cz>
+ * Project : Shell - benchmark
+ *
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BUFFER_SIZE 4096
+#define LINE_SIZE 65536
+#define COMMANDS 2000
+#define LONG_ARGS 1000
+#define PARSE_LINES 20000
+#define PARSE_ARGS 200
+
+static const char *PROMPT = "$ ";
+// Prefix of the time stamp written by a launched command.
+static const char STAMP = '@';
+
+/*
+ * Running instance of the benchmarked shell.
+ *
+*/
+typedef struct {
+	// Pid of the shell.
+	pid_t pid;
+	// Shell's stdin.
+	int in;
+	// Shell's stdout.
+	int out;
+	// Shell's stderr, shared by commands it launches.
+	int err;
+} shell_t;
+
+/*
+ * Latencies of a single phase of command execution.
+ *
+*/
+typedef struct {
+	// Latency of each command in microseconds.
+	double *samples;
+	// Number of recorded samples.
+	int count;
+} phase_t;
+
+/*
+ * Synthetic workload sent to the shell.
+ *
+*/
+typedef struct {
+	// Name used in the report.
+	const char *name;
+	// Arguments following the stamping command.
+	const char *args;
+	// Redirections and '&', following the arguments.
+	const char *suffix;
+} workload_t;
+
+/*
+ * Current time of the monotonic clock in seconds.
+ * Commands launched by the benchmark report it as their stamp.
+ *
+*/
+double time_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Start the shell with stdin and stdout connected to pipes.
+ * Arguments are passed to the shell unchanged.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int shell_start(shell_t *shell, char *const args[]) {
+	int fd_in[2], fd_out[2], fd_err[2];
+
+	if (pipe(fd_in) == -1 || pipe(fd_out) == -1 || pipe(fd_err) == -1) {
+		perror("pipe");
+		return -1;
+	}
+
+	if ((shell->pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (shell->pid == 0) {
+		if (dup2(fd_in[0], STDIN_FILENO) == -1 || dup2(fd_out[1], STDOUT_FILENO) == -1 ||
+			dup2(fd_err[1], STDERR_FILENO) == -1)
+		{
+			perror("dup2");
+			exit(EXIT_FAILURE);
+		}
+
+		close(fd_in[0]);
+		close(fd_in[1]);
+		close(fd_out[0]);
+		close(fd_out[1]);
+		close(fd_err[0]);
+		close(fd_err[1]);
+
+		execv(args[0], args);
+		perror("execv");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd_in[0]);
+	close(fd_out[1]);
+	close(fd_err[1]);
+	shell->in = fd_in[1];
+	shell->out = fd_out[0];
+	shell->err = fd_err[0];
+
+	return 0;
+}
+
+/*
+ * Read shell's output until the prompt is displayed.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int shell_wait_prompt(shell_t *shell) {
+	size_t prompt_len = strlen(PROMPT);
+	char buffer[BUFFER_SIZE];
+	size_t len = 0;
+	ssize_t num_bytes;
+
+	while (1) {
+		if ((num_bytes = read(shell->out, buffer + len, sizeof(buffer) - len)) <= 0) {
+			if (num_bytes < 0 && errno == EINTR) {
+				continue;
+			}
+
+			fprintf(stderr, "Shell terminated unexpectedly.\n");
+			return -1;
+		}
+
+		len += num_bytes;
+
+		if (len >= prompt_len && memcmp(buffer + len - prompt_len, PROMPT, prompt_len) == 0) {
+			return 0;
+		}
+
+		// Only the tail of the output is interesting.
+		if (len == sizeof(buffer)) {
+			memmove(buffer, buffer + len - prompt_len, prompt_len);
+			len = prompt_len;
+		}
+	}
+}
+
+/*
+ * Read shell's stderr until a launched command writes its stamp.
+ * Anything else written there is passed to our stderr.
+ * Returns the stamp on success; -1 otherwise.
+ *
+*/
+double shell_wait_stamp(shell_t *shell) {
+	char buffer[BUFFER_SIZE];
+	size_t len = 0;
+	ssize_t num_bytes;
+	char *end;
+
+	while (1) {
+		if ((num_bytes = read(shell->err, buffer + len, sizeof(buffer) - len - 1)) <= 0) {
+			if (num_bytes < 0 && errno == EINTR) {
+				continue;
+			}
+
+			fprintf(stderr, "Shell terminated unexpectedly.\n");
+			return -1;
+		}
+
+		len += num_bytes;
+		buffer[len] = '\0';
+
+		while ((end = strchr(buffer, '\n')) != NULL) {
+			*end = '\0';
+
+			if (buffer[0] == STAMP) {
+				return strtod(buffer + 1, NULL);
+			}
+
+			fprintf(stderr, "%s\n", buffer);
+			len -= end + 1 - buffer;
+			memmove(buffer, end + 1, len + 1);
+		}
+
+		if (len == sizeof(buffer) - 1) {
+			len = 0;
+		}
+	}
+}
+
+/*
+ * Send a single line to the shell.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int shell_send(shell_t *shell, const char *line) {
+	size_t len = strlen(line);
+	ssize_t num_bytes;
+
+	while (len > 0) {
+		if ((num_bytes = write(shell->in, line, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("write");
+			return -1;
+		}
+
+		line += num_bytes;
+		len -= num_bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Tell the shell to exit and wait for it.
+ *
+*/
+void shell_stop(shell_t *shell) {
+	shell_send(shell, "exit\n");
+	close(shell->in);
+	close(shell->out);
+	close(shell->err);
+	waitpid(shell->pid, NULL, 0);
+}
+
+/*
+ * Comparison of samples for qsort.
+ *
+*/
+int sample_compare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sample of the phase below which 'percent' of its samples lie.
+ * Samples get sorted.
+ *
+*/
+double phase_percentile(phase_t *phase, int percent) {
+	qsort(phase->samples, phase->count, sizeof(double), sample_compare);
+
+	return phase->samples[(long) phase->count * percent / 100];
+}
+
+/*
+ * Print latencies of the phase as 'name'_p50_us and 'name'_p99_us.
+ *
+*/
+void phase_print(phase_t *phase, const char *name) {
+	printf(" %s_p50_us=%.1f %s_p99_us=%.1f", name, phase_percentile(phase, 50),
+		name, phase_percentile(phase, 99));
+}
+
+/*
+ * Run 'count' commands of the workload one by one, each one is sent
+ * only after the prompt for it was displayed. Every command is this
+ * benchmark writing its stamp, which splits the latency into the
+ * launch (line sent until the command runs) and the return (command
+ * runs until the next prompt) phases. A line of results is printed.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int bench_launch(char *const args[], const char *mode, const char *self, workload_t *workload, int count) {
+	phase_t launch = {NULL, 0}, back = {NULL, 0}, total = {NULL, 0};
+	double start, sent, stamp, elapsed;
+	char *line;
+	shell_t shell;
+	int result = -1;
+
+	if ((line = malloc(LINE_SIZE)) == NULL || (launch.samples = malloc(count * sizeof(double))) == NULL ||
+		(back.samples = malloc(count * sizeof(double))) == NULL ||
+		(total.samples = malloc(count * sizeof(double))) == NULL)
+	{
+		perror("malloc");
+		goto cleanup;
+	}
+
+	snprintf(line, LINE_SIZE, "%s -s%s%s\n", self, workload->args, workload->suffix);
+
+	if (shell_start(&shell, args) != 0) {
+		goto cleanup;
+	}
+
+	if (shell_wait_prompt(&shell) != 0) {
+		shell_stop(&shell);
+		goto cleanup;
+	}
+
+	start = time_now();
+
+	for (int i = 0; i < count; i++) {
+		sent = time_now();
+
+		if (shell_send(&shell, line) != 0 || (stamp = shell_wait_stamp(&shell)) < 0 ||
+			shell_wait_prompt(&shell) != 0)
+		{
+			shell_stop(&shell);
+			goto cleanup;
+		}
+
+		elapsed = time_now();
+		launch.samples[launch.count++] = (stamp - sent) * 1e6;
+		back.samples[back.count++] = (elapsed - stamp) * 1e6;
+		total.samples[total.count++] = (elapsed - sent) * 1e6;
+	}
+
+	elapsed = time_now() - start;
+	shell_stop(&shell);
+
+	printf("workload=%s mode=%s commands=%d commands_per_sec=%.0f", workload->name, mode, count, count / elapsed);
+	phase_print(&launch, "launch");
+	phase_print(&back, "return");
+	phase_print(&total, "total");
+	printf("\n");
+	fflush(stdout);
+	result = 0;
+
+cleanup:
+	free(line);
+	free(launch.samples);
+	free(back.samples);
+	free(total.samples);
+
+	return result;
+}
+
+/*
+ * Write a corpus of 'lines' commands, each with 'args' arguments
+ * and both redirections, into a temporary file.
+ * Returns size of the corpus in bytes; -1 on failure.
+ *
+*/
+long corpus_write(char *path, int lines, int args) {
+	FILE *file;
+	long size;
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1) {
+		perror("mkstemp");
+		return -1;
+	}
+
+	if ((file = fdopen(fd, "w")) == NULL) {
+		perror("fdopen");
+		close(fd);
+		return -1;
+	}
+
+	for (int i = 0; i < lines; i++) {
+		fprintf(file, "command%d", i);
+
+		for (int j = 0; j < args; j++) {
+			fprintf(file, " --arg%d=value%d", j, i);
+		}
+
+		fprintf(file, " < input%d > output%d\n", i, i);
+	}
+
+	size = ftell(file);
+	fclose(file);
+
+	return size;
+}
+
+/*
+ * Let the shell only parse a corpus of 'lines' commands with
+ * 'args' arguments each.
+ * Returns parsed megabytes per second; -1 on failure.
+ *
+*/
+double bench_parse(int lines, int args) {
+	char path[] = "/tmp/shell-bench-XXXXXX";
+	char *shell_args[] = {"./shell", "-n", "-f", path, NULL};
+	double start, elapsed;
+	int status;
+	long size;
+	pid_t pid;
+
+	if ((size = corpus_write(path, lines, args)) < 0) {
+		return -1;
+	}
+
+	start = time_now();
+
+	if ((pid = fork()) == 0) {
+		execv(shell_args[0], shell_args);
+		perror("execv");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid < 0 || waitpid(pid, &status, 0) == -1 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Shell failed to parse the corpus.\n");
+		unlink(path);
+		return -1;
+	}
+
+	elapsed = time_now() - start;
+	unlink(path);
+
+	return size / elapsed / (1024 * 1024);
+}
+
+/*
+ * Write the stamp to stderr. This is what commands launched
+ * by the benchmarked shell do.
+ *
+*/
+void stamp() {
+	fprintf(stderr, "%c%.9f\n", STAMP, time_now());
+}
+
+int main(int argc, char *argv[]) {
+	char *spawn_args[] = {"./shell", NULL};
+	char *fork_args[] = {"./shell", "-F", NULL};
+	char *zygote_args[] = {"./shell", "-Z", NULL};
+	char *const *modes[] = {spawn_args, fork_args, zygote_args};
+	const char *mode_names[] = {"spawn", "fork", "zygote"};
+	char out_path[] = "/tmp/shell-bench-XXXXXX";
+	char long_args[LINE_SIZE / 2], redirects[BUFFER_SIZE];
+	workload_t workloads[] = {
+		{"true", "", ""},
+		{"argv", long_args, ""},
+		{"redirect", "", redirects},
+		{"background", "", " &"},
+	};
+	int count = COMMANDS;
+	double parse_rate;
+	size_t len = 0;
+	int fd;
+
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		stamp();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+
+	if (count <= 0 || strchr(argv[0], '/') == NULL) {
+		fprintf(stderr, "Usage: %s [commands]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((fd = mkstemp(out_path)) == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	for (int i = 0; i < LONG_ARGS; i++) {
+		len += snprintf(long_args + len, sizeof(long_args) - len, " argument%d", i);
+	}
+
+	snprintf(redirects, sizeof(redirects), " < /dev/null > %s", out_path);
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		for (size_t j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			if (bench_launch(modes[j], mode_names[j], argv[0], &workloads[i], count) != 0) {
+				unlink(out_path);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	unlink(out_path);
+
+	if ((parse_rate = bench_parse(PARSE_LINES, PARSE_ARGS)) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("workload=parse lines=%d args=%d mb_per_sec=%.1f\n", PARSE_LINES, PARSE_ARGS, parse_rate);
+
+	exit(EXIT_SUCCESS);
+}
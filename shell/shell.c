@@ -4,29 +4,141 @@
  *
 */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <pthread.h>
+#include <linux/ioprio.h>
+#include <dirent.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <time.h>
 
-#define EFFECTIVE_BUFFER_SIZE 512
-#define BUFFER_SIZE 513
-#define ARGS_SIZE 4
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Spawned command mustn't inherit shell's descriptors, only glibc
+// 2.34 and newer can close them. Commands are forked otherwise.
+#if defined(_POSIX_SPAWN) && defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+#define SPAWN_CLOSEFROM
+#endif
+
+#define READ_SIZE 65536
+#define ARGS_SIZE 16
+#define ARENA_SIZE 4096
+#define PATH_CACHE_SIZE 64
+#define SIGNALS_SIZE 16
+#define EVENTS_SIZE 64
+#define JOBS_SIZE 16
+#define TYPEAHEAD_SIZE 64
+#define PARSE_ERROR_SIZE 128
+#define PARSE_CACHE_SIZE 64
+#define BUILTINS_SIZE 16
+#define COPY_SIZE (8 << 20)
+#define TRACE_SIZE 4096
+
+/*
+ * Block of memory of an arena.
+ *
+*/
+typedef struct arena_block_t {
+	// Previous block, which was already full.
+	struct arena_block_t *prev;
+	// Usable size of the block.
+	size_t size;
+	char data[];
+} arena_block_t;
+
+/*
+ * Bump allocator. Memory is allocated from the current block,
+ * individual allocations are never freed, the whole arena is
+ * reset at once instead.
+ *
+*/
+typedef struct {
+	// Current block; NULL if nothing was allocated yet.
+	arena_block_t *block;
+	// Number of bytes used in the current block.
+	size_t used;
+} arena_t;
 
 /*
  * Represents a command entered by the user.
  *
 */
+struct command_t;
+
+/*
+ * Scheduling of a command's process, set up before the exec.
+ *
+*/
 typedef struct {
+	// True if 'cpus' should be set as the process' affinity.
+	int has_cpus;
+	cpu_set_t cpus;
+	// True if 'nice' should be set as the process' nice value.
+	int has_nice;
+	int nice;
+	// Scheduling policy and its priority; -1 to keep the shell's one.
+	int policy;
+	int priority;
+	// I/O priority as for ioprio_set; -1 to keep the shell's one.
+	int ioprio;
+	// CPU the whole pipeline was pinned to in the parallel mode,
+	// taken until its last stage terminates; -1 if there is none.
+	int cpu;
+} sched_t;
+
+/*
+ * Argument of a command replaced by output of another command.
+ *
+*/
+typedef struct substitution_t {
+	// Position of the replaced argument.
+	size_t pos;
+	// Command whose output replaces the argument.
+	struct command_t *command;
+	// Next substitution of the same command, in order of positions.
+	struct substitution_t *next;
+} substitution_t;
+
+/*
+ * Here-document of a line whose body wasn't reached by the parser
+ * yet.
+ *
+*/
+typedef struct here_doc_t {
+	// Command whose input is the body.
+	struct command_t *command;
+	// Delimiter without quotes.
+	char *delim;
+	size_t delim_len;
+	// Next here-document of the line, in order of appearance.
+	struct here_doc_t *next;
+} here_doc_t;
+
+typedef struct command_t {
 	// True if the command should be interrupt in background.
 	int run_in_bg;
 	// NULL-terminated array of command's arguments.
@@ -35,589 +147,4897 @@ typedef struct {
 	char *out;
 	// Name of the file to redirect command's stdin to.
 	char *in;
+	// Contents of a here-document or a here-string to feed
+	// to command's stdin instead; NULL if there is none.
+	char *here;
+	size_t here_len;
+	// True if resource usage of the command should be reported.
+	int timed;
+	// Substituted arguments; NULL if there are none.
+	substitution_t *substitutions;
+	// Scheduling of the command; NULL to keep the shell's one.
+	sched_t *sched;
+	// Next stage of the pipeline; NULL if this is the last one.
+	struct command_t *next;
+	// Next command of the list and the operator, how it depends on
+	// exit status of this one; NULL and '\0' if this is the last one.
+	// Set only in the first stage of a pipeline.
+	struct command_t *list_next;
+	char list_op;
 } command_t;
 
 static inline void command_clear(command_t *command) {
-	free(command->args);
+	command->run_in_bg = 0;
+	// Arguments are allocated from an arena, strings point
+	// to the 'line'. No freeing needed.
+	command->args = NULL;
+	command->out = NULL;
+	command->in = NULL;
+	command->here = NULL;
+	command->here_len = 0;
+	command->timed = 0;
+	command->substitutions = NULL;
+	command->sched = NULL;
+	command->next = NULL;
+	command->list_next = NULL;
+	command->list_op = '\0';
+}
+
+/*
+ * Represents a process executing user's command.
+ *
+*/
+typedef struct {
+	// Pid of the process; zero if the record is unused.
+	pid_t pid;
+	// True if the process is still running.
+	// This is set to false when its pidfd becomes readable.
+	int running;
+	// Descriptor referring to the process, registered in the event
+	// loop while the process is running; -1 once it was reaped.
+	int pidfd;
+	// Exit status, or 128 + number of the terminating signal.
+	int status;
+	// True if the process inherited shell's input.
+	int shares_input;
+	// True if the process is the last stage of a pipeline, whose
+	// exit status is the pipeline's one.
+	int last_stage;
+	// True if the shell waits for the process to terminate
+	// before executing next command.
+	int foreground;
+	// True if resource usage should be reported once it terminates.
+	int timed;
+	// Monotonic time the process was launched and reaped at.
+	struct timespec started;
+	struct timespec finished;
+	// Resource usage of the terminated process.
+	struct rusage usage;
+	// CPU the process was pinned to in the parallel mode; -1 if none.
+	int cpu;
+	// Next record in the list of unused records or in the queue
+	// of finished processes; -1 if there is none.
+	int next;
+} process_t;
+
+/*
+ * Table of tracked processes. Records are stored in a contiguous
+ * slab and referred to by their position in it. Lookup by pid
+ * is done through an open-addressing hash table.
+ *
+*/
+typedef struct {
+	// Slab of process records.
+	process_t *slab;
+	// Number of records in the slab, always a power of two.
+	int size;
+	// Number of used records.
+	int count;
+	// First unused record; -1 if the slab is full.
+	int free;
+	// Hash table of record positions keyed by their pid, with linear
+	// probing and twice as many buckets as records. Empty bucket is -1.
+	int *index;
+	// Queue of terminated background processes waiting for
+	// notification, oldest first; -1 if it is empty.
+	int finished_head;
+	int finished_tail;
+} jobs_t;
+
+/*
+ * Command parsed ahead while the shell waits for processes.
+ *
+*/
+typedef struct {
+	// Owns the copy of the input line and command's arguments.
+	arena_t arena;
+	// The parsed command. Its strings point to the line or its copy.
+	command_t command;
+	// Error of a line which couldn't be parsed, reported only once
+	// the line is reached. Empty if there is none.
+	char error[PARSE_ERROR_SIZE];
+} typeahead_t;
+
+/*
+ * Line parsed earlier, kept to be reused when the same line
+ * is entered again.
+ *
+*/
+typedef struct {
+	// Text of the line as read; NULL if the entry is unused.
+	char *text;
+	size_t len;
+	// Text of the line after it was parsed in place.
+	char *tokens;
+	// The parsed command. Its strings point to the parsed text.
+	command_t command;
+	// Time of the last use, for eviction of the least recently used.
+	unsigned long used;
+	// Owns the texts and command's arguments.
+	arena_t arena;
+} parse_entry_t;
+
+/*
+ * Location of an executable found in the PATH.
+ *
+*/
+typedef struct path_entry_t {
+	// Simple linked list of entries in the same bucket.
+	struct path_entry_t *next;
+	// Name of the command.
+	char *name;
+	// Absolute path of the executable.
+	char *path;
+	// Number of times the entry was used.
+	unsigned hits;
+} path_entry_t;
+
+static inline void path_entry_free(path_entry_t *entry) {
+	free(entry->name);
+	free(entry->path);
+	free(entry);
+}
+
+/*
+ * Growable buffer.
+ *
+*/
+typedef struct {
+	char *data;
+	// Allocated size of the 'data'.
+	size_t size;
+	// Number of used bytes.
+	size_t len;
+} buffer_t;
+
+/*
+ * Buffered reader splitting input into lines.
+ *
+*/
+typedef struct {
+	// Descriptor the input is read from.
+	int fd;
+	// True once the end of input was reached.
+	int eof;
+	// Growable buffer with the input data.
+	char *data;
+	// Allocated size of the 'data'.
+	size_t size;
+	// Beginning of data not yet returned as a line.
+	size_t start;
+	// End of data read into the buffer.
+	size_t end;
+	// Data up to this point were already searched for a new line.
+	size_t scanned;
+} reader_t;
+
+static const char *CMD_EXIT = "exit";
+static const char *CMD_TIME = "time";
+static const char *CMD_SCHED = "sched";
+static const char *CMD_CAT = "cat";
+static const char *PROMPT = "$ ";
+
+// Used when PATH isn't set at all.
+static const char *DEFAULT_PATH = "/bin:/usr/bin";
+// Runs executables which aren't recognized by the kernel.
+static const char *SCRIPT_SHELL = "/bin/sh";
+
+// Event loop sources other than tracked processes, which are
+// identified by their pid.
+static const uint64_t EVENT_SIGNAL = 1ULL << 32;
+static const uint64_t EVENT_INPUT = 2ULL << 32;
+
+static const char RUN_IN_BG = '&';
+static const char PIPE = '|';
+static const char SUBST = '$';
+static const char SUBST_OPEN = '(';
+static const char SUBST_CLOSE = ')';
+// Tokens of a here-document ('<<') and a here-string ('<<<').
+// These aren't symbols of the input.
+static const char REDIR_HERE_DOC = 'D';
+static const char REDIR_HERE_STR = 'S';
+static const char REDIR_OUT = '>';
+static const char REDIR_IN = '<';
+// Operators of a list: ';', '&&' and '||'. Single '&' works like
+// ';', except that the previous command runs in background.
+static const char LIST_SEQ = ';';
+static const char LIST_AND = 'A';
+static const char LIST_OR = 'O';
+
+/*
+ * Ways of launching a command's process.
+ *
+*/
+typedef enum {
+	// posix_spawn, implemented with vfork-like clone in glibc.
+	// Doesn't copy shell's page tables.
+	LAUNCH_SPAWN,
+	// Plain fork followed by exec in the child.
+	LAUNCH_FORK,
+	// Fork followed by exec in the zygote, a small process forked
+	// at startup. Its fork doesn't depend on shell's size.
+	LAUNCH_ZYGOTE,
+} launch_t;
+
+/*
+ * Request to launch a command sent to the zygote. It is followed
+ * by null-terminated new working directory, if requested, path of
+ * the executable, arguments and environment variables. Descriptors
+ * for the command's stdin and stdout are attached.
+ *
+*/
+typedef struct {
+	// True if the command runs in background.
+	int run_in_bg;
+	// True if the zygote should change its working directory first.
+	int chdir;
+	// Number of arguments.
+	int argc;
+	// Number of environment variables.
+	int envc;
+} zygote_request_t;
+
+/*
+ * Reply of the zygote to a launch request.
+ *
+*/
+typedef struct {
+	// Pid of the launched process; -1 on failure.
+	pid_t pid;
+	// Cause of the failure.
+	int error;
+} zygote_reply_t;
+
+/*
+ * Phase of the lifecycle of a command recorded in the trace.
+ *
+*/
+typedef struct {
+	// Name of the phase; has to be a string literal.
+	const char *name;
+	// Process the phase belongs to, the shell or a command.
+	pid_t pid;
+	// Start and end of the phase on the monotonic clock in nanoseconds.
+	int64_t start;
+	int64_t end;
+} trace_event_t;
+
+/*
+ * Command executed by the shell itself, without launching a process.
+ *
+*/
+typedef struct {
+	// Name of the command; NULL in unused entries of the table.
+	const char *name;
+	// Executes the command, returns its exit status.
+	int (*handler)(command_t *command);
+} builtin_t;
+
+static int interrupt = 0;
+// Number of running foreground processes, stages of a pipeline.
+static int fg_processes = 0;
+// Resource usage of the timed foreground pipeline, summed over its
+// terminated stages, and time its first stage was launched. Usage
+// is reported once all of its stages terminate.
+static int fg_timed = 0;
+static struct rusage fg_usage;
+static struct timespec fg_started;
+// Exit status of the last command which ran in foreground.
+static int last_status = 0;
+static jobs_t jobs = {NULL, 0, 0, -1, NULL, -1, -1};
+
+static reader_t input = {STDIN_FILENO, 0, NULL, 0, 0, 0, 0};
+static char *line = NULL;
+static size_t line_len = 0;
+// Owns arguments of the command parsed directly from the 'line'.
+static arena_t command_arena = {NULL, 0};
+// Owns data of the command created once it runs, such as arguments
+// replaced by substitutions or its scheduling.
+static arena_t run_arena = {NULL, 0};
+// Output of the substituted command being read.
+static buffer_t substitution_output = {NULL, 0, 0};
+// True if commands should be only parsed, not executed.
+static int noexec = 0;
+// False when executing a script or a single command.
+static int interactive = 1;
+// Maximum number of concurrently running commands in the parallel
+// mode. Zero when the parallel mode isn't used.
+static int jobs_max = 0;
+// Number of running commands in the parallel mode.
+static int jobs_running = 0;
+// True if commands in the parallel mode should be pinned to CPUs
+// not used by the other running commands.
+static int jobs_pin = 0;
+// CPUs the shell may run on and those commands are pinned to.
+static cpu_set_t jobs_cpus;
+static cpu_set_t jobs_cpus_used;
+// Capacity of pipes connecting stages of a pipeline in bytes.
+// Zero to keep the system's default.
+static int pipe_size = 0;
+// True if resource usage of every background process should be
+// reported along with its notification.
+static int jobs_timed = 0;
+
+// Queue of commands parsed ahead. Positions of the oldest command
+// and of the next free entry are free-running, used modulo its size.
+static typeahead_t typeahead[TYPEAHEAD_SIZE];
+static unsigned typeahead_head = 0;
+static unsigned typeahead_tail = 0;
+// Where an error of the line being parsed ahead is kept; NULL to
+// print errors right away.
+static char *parse_error_buffer = NULL;
+// Number of running processes which inherited shell's input.
+// Input isn't read ahead while there are any, not to steal their data.
+static int input_sharers = 0;
+
+// Lines parsed earlier and hashes of their texts, searched all at once.
+static parse_entry_t parse_cache[PARSE_CACHE_SIZE];
+static uint64_t parse_cache_hashes[PARSE_CACHE_SIZE];
+// Hashes of lines which missed the cache, by the hash. Line is kept
+// only once it misses again, lines seen once aren't copied at all.
+static uint64_t parse_cache_seen[PARSE_CACHE_SIZE];
+// Number of uses of the cache so far, which serves as its clock.
+static unsigned long parse_cache_hits = 0;
+static unsigned long parse_cache_misses = 0;
+// Text of the line being parsed as it was read.
+static buffer_t parse_cache_key = {NULL, 0, 0};
+
+// Executables resolved from the PATH, keyed by command name.
+static path_entry_t *path_cache[PATH_CACHE_SIZE];
+// Value of PATH the cached entries were resolved with.
+static char *path_cache_env = NULL;
+
+// Event loop multiplexing the input and signals.
+static int epoll_fd = -1;
+// SIGINT is blocked and received through this descriptor.
+static int signal_fd = -1;
+// True if the input is registered in the event loop. Regular
+// files can't be polled, they are always ready to be read.
+static int input_polled = 0;
+// True if the input is armed to report readiness once.
+static int input_armed = 0;
+
+// Socket connected to the zygote and its pid; -1 if it isn't running.
+static int zygote_fd = -1;
+static pid_t zygote_pid = -1;
+// Launch request being sent to the zygote.
+static buffer_t zygote_request = {NULL, 0, 0};
+// True if shell's working directory changed since the last request.
+static int zygote_chdir = 0;
+
+// Trace file; -1 if tracing is disabled.
+static int trace_fd = -1;
+// Events recorded since the trace file was written last time.
+static trace_event_t trace_events[TRACE_SIZE];
+static int trace_count = 0;
+// Pid of the shell, the trace's process.
+static pid_t trace_pid = 0;
+// Separator written before the next event in the trace file.
+static const char *trace_separator = "";
+
+#ifdef SPAWN_CLOSEFROM
+static launch_t launch_mode = LAUNCH_SPAWN;
+#else
+static launch_t launch_mode = LAUNCH_FORK;
+#endif
+
+/*
+ * Allocate 'size' bytes from the arena, aligned for pointers.
+ * If the current block is full, twice as large one is added.
+ * Returns the allocated memory; NULL on failure.
+ *
+*/
+void *arena_alloc(arena_t *arena, size_t size) {
+	arena_block_t *block = arena->block;
+	size_t block_size;
+	void *memory;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (block == NULL || block->size - arena->used < size) {
+		block_size = block == NULL ? ARENA_SIZE : 2 * block->size;
+
+		while (block_size < size) {
+			block_size <<= 1;
+		}
+
+		if ((block = malloc(sizeof(arena_block_t) + block_size)) == NULL) {
+			perror("malloc");
+			return NULL;
+		}
+
+		block->prev = arena->block;
+		block->size = block_size;
+		arena->block = block;
+		arena->used = 0;
+	}
+
+	memory = block->data + arena->used;
+	arena->used += size;
+
+	return memory;
+}
+
+/*
+ * Release all memory allocated from the arena. Only the current,
+ * largest, block is kept. Once the arena is large enough for
+ * a typical command, this is O(1).
+ *
+*/
+void arena_reset(arena_t *arena) {
+	arena_block_t *prev;
+
+	if (arena->block != NULL) {
+		while ((prev = arena->block->prev) != NULL) {
+			arena->block->prev = prev->prev;
+			free(prev);
+		}
+	}
+
+	arena->used = 0;
+}
+
+/*
+ * Time 'ts' on the monotonic clock in nanoseconds.
+ *
+*/
+static inline int64_t trace_time(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/*
+ * Start of a traced phase.
+ * Returns the current time; 0 if tracing is disabled.
+ *
+*/
+static inline int64_t trace_begin() {
+	struct timespec now;
+
+	// Tracing is an exception, the check shouldn't cost anything else.
+	if (__builtin_expect(trace_fd == -1, 1)) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return trace_time(&now);
+}
+
+/*
+ * Write the recorded events to the trace file as Chrome trace
+ * events, in microseconds.
+ *
+*/
+void trace_flush() {
+	char chunk[READ_SIZE];
+	size_t len = 0;
+	trace_event_t *event;
+
+	for (int i = 0; i <= trace_count; i++) {
+		// Write the chunk once another event might not fit.
+		if (i == trace_count || len > sizeof(chunk) - 256) {
+			if (write(trace_fd, chunk, len) != (ssize_t) len) {
+				perror("write");
+			}
+
+			len = 0;
+		}
+
+		if (i < trace_count) {
+			event = &trace_events[i];
+			len += snprintf(chunk + len, sizeof(chunk) - len,
+				"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				trace_separator, event->name, (int) trace_pid, (int) event->pid,
+				event->start / 1e3, (event->end - event->start) / 1e3);
+			trace_separator = ",\n";
+		}
+	}
+
+	trace_count = 0;
+}
+
+/*
+ * Record the phase 'name' of the process 'pid' from 'start' to 'end'.
+ *
+*/
+void trace_record(const char *name, pid_t pid, int64_t start, int64_t end) {
+	if (trace_count == TRACE_SIZE) {
+		trace_flush();
+	}
+
+	trace_events[trace_count].name = name;
+	trace_events[trace_count].pid = pid;
+	trace_events[trace_count].start = start;
+	trace_events[trace_count].end = end;
+	trace_count++;
+}
+
+/*
+ * End of the phase 'name' of the process 'pid' started at 'start',
+ * as returned by trace_begin().
+ *
+*/
+static inline void trace_end(const char *name, pid_t pid, int64_t start) {
+	if (__builtin_expect(start != 0, 0)) {
+		trace_record(name, pid, start, trace_begin());
+	}
+}
+
+/*
+ * Open the trace file 'path' and enable tracing.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int trace_open(const char *path) {
+	static const char header[] = "{\"traceEvents\":[\n";
+
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1) {
+		fprintf(stderr, "Couldn't open trace file '%s'.\n", path);
+		return -1;
+	}
+
+	if (write(trace_fd, header, sizeof(header) - 1) == -1) {
+		perror("write");
+	}
+
+	trace_pid = getpid();
+
+	return 0;
+}
+
+/*
+ * Write the remaining events and terminate the trace file.
+ *
+*/
+void trace_close() {
+	static const char footer[] = "\n]}\n";
+
+	if (trace_fd == -1) {
+		return;
+	}
+
+	trace_flush();
+
+	if (write(trace_fd, footer, sizeof(footer) - 1) == -1) {
+		perror("write");
+	}
+
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/*
+ * Bucket of the jobs' index where the search for 'pid' starts.
+ *
+*/
+static inline int jobs_hash(pid_t pid) {
+	return ((unsigned) pid * 2654435761u) & (2 * jobs.size - 1);
+}
+
+/*
+ * Insert record 'slot' into the jobs' index.
+ *
+*/
+static inline void jobs_index(int slot) {
+	int mask = 2 * jobs.size - 1;
+	int bucket = jobs_hash(jobs.slab[slot].pid);
+
+	while (jobs.index[bucket] != -1) {
+		bucket = (bucket + 1) & mask;
+	}
+
+	jobs.index[bucket] = slot;
+}
+
+/*
+ * Double the size of the jobs' slab and rebuild its index.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int jobs_grow() {
+	int size = jobs.size == 0 ? JOBS_SIZE : 2 * jobs.size;
+	process_t *slab;
+	int *index;
+
+	if ((slab = realloc(jobs.slab, size * sizeof(process_t))) == NULL) {
+		perror("realloc");
+		return -1;
+	}
+
+	jobs.slab = slab;
+
+	if ((index = malloc(2 * size * sizeof(int))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	// Slab is grown only when full, new records are all unused.
+	for (int i = jobs.size; i < size; i++) {
+		slab[i].pid = 0;
+		slab[i].next = i + 1 < size ? i + 1 : -1;
+	}
+
+	jobs.free = jobs.size;
+	jobs.size = size;
+
+	free(jobs.index);
+	jobs.index = index;
+
+	for (int i = 0; i < 2 * size; i++) {
+		index[i] = -1;
+	}
+
+	for (int i = 0; i < size; i++) {
+		if (slab[i].pid != 0) {
+			jobs_index(i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Take an unused record for the process 'pid'.
+ * Returns position of the record; -1 on failure.
+ *
+*/
+int jobs_add(pid_t pid) {
+	int slot;
+
+	if (jobs.free == -1 && jobs_grow() != 0) {
+		return -1;
+	}
+
+	slot = jobs.free;
+	jobs.free = jobs.slab[slot].next;
+
+	jobs.slab[slot].pid = pid;
+	jobs.slab[slot].running = 1;
+	jobs.slab[slot].pidfd = -1;
+	jobs.slab[slot].status = 0;
+	jobs.slab[slot].shares_input = 0;
+	jobs.slab[slot].timed = 0;
+	jobs.slab[slot].foreground = 0;
+	jobs.slab[slot].last_stage = 0;
+	jobs.slab[slot].cpu = -1;
+	jobs.slab[slot].next = -1;
+	jobs_index(slot);
+	jobs.count++;
+
+	return slot;
+}
+
+/*
+ * Find the record of the process 'pid'.
+ * Returns position of the record; -1 if there is none.
+ *
+*/
+int jobs_find(pid_t pid) {
+	int mask = 2 * jobs.size - 1;
+	int bucket;
+
+	if (jobs.size == 0) {
+		return -1;
+	}
+
+	for (bucket = jobs_hash(pid); jobs.index[bucket] != -1; bucket = (bucket + 1) & mask) {
+		if (jobs.slab[jobs.index[bucket]].pid == pid) {
+			return jobs.index[bucket];
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Return the record 'slot' among the unused ones.
+ *
+*/
+void jobs_remove(int slot) {
+	int mask = 2 * jobs.size - 1;
+	int bucket, next, home;
+
+	for (bucket = jobs_hash(jobs.slab[slot].pid); jobs.index[bucket] != slot; bucket = (bucket + 1) & mask);
+	jobs.index[bucket] = -1;
+
+	// Move following records of the cluster into the emptied bucket,
+	// unless it lies before their home bucket. Lookups can't stop
+	// at the hole prematurely then.
+	for (next = (bucket + 1) & mask; jobs.index[next] != -1; next = (next + 1) & mask) {
+		home = jobs_hash(jobs.slab[jobs.index[next]].pid);
+
+		if (((next - home) & mask) >= ((next - bucket) & mask)) {
+			jobs.index[bucket] = jobs.index[next];
+			jobs.index[next] = -1;
+			bucket = next;
+		}
+	}
+
+	jobs.slab[slot].pid = 0;
+	jobs.slab[slot].next = jobs.free;
+	jobs.free = slot;
+	jobs.count--;
+}
+
+/*
+ * Append the record 'slot' to the queue of finished processes.
+ *
+*/
+void jobs_finished_push(int slot) {
+	jobs.slab[slot].next = -1;
+
+	if (jobs.finished_tail == -1) {
+		jobs.finished_head = slot;
+	} else {
+		jobs.slab[jobs.finished_tail].next = slot;
+	}
+
+	jobs.finished_tail = slot;
+}
+
+/*
+ * Take the oldest record from the queue of finished processes.
+ * Returns position of the record; -1 if the queue is empty.
+ *
+*/
+int jobs_finished_pop() {
+	int slot = jobs.finished_head;
+
+	if (slot != -1) {
+		if ((jobs.finished_head = jobs.slab[slot].next) == -1) {
+			jobs.finished_tail = -1;
+		}
+	}
+
+	return slot;
+}
+
+/*
+ * Stop tracking the process in the record 'slot'.
+ *
+*/
+static inline void process_free(int slot) {
+	if (jobs.slab[slot].pidfd != -1) {
+		close(jobs.slab[slot].pidfd);
+	}
+
+	jobs_remove(slot);
+}
+
+/*
+ * Start tracking the child process 'pid'. The process is referred
+ * to by a pidfd registered in the event loop, so its termination
+ * is delivered exactly once and its pid can't be reused meanwhile.
+ * Returns position of the process' record on success; -1 otherwise.
+ *
+*/
+int process_track(pid_t pid) {
+	struct epoll_event event;
+	int slot;
+
+	if ((slot = jobs_add(pid)) == -1) {
+		return -1;
+	}
+
+	// Child isn't reaped until its pidfd is readable,
+	// the pid can't refer to any other process.
+	if ((jobs.slab[slot].pidfd = pidfd_open(pid, 0)) == -1) {
+		perror("pidfd_open");
+		process_free(slot);
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = pid;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, jobs.slab[slot].pidfd, &event) == -1) {
+		perror("epoll_ctl");
+		process_free(slot);
+		return -1;
+	}
+
+	return slot;
+}
+
+/*
+ * Print resource 'usage' of a command running from 'started' until
+ * 'finished' as a single line: wall time, user and system CPU time,
+ * maximum resident set size and voluntary/involuntary context
+ * switches.
+ *
+*/
+void usage_print(FILE *stream, const struct timespec *started, const struct timespec *finished,
+	const struct rusage *usage)
+{
+	double real;
+
+	real = (finished->tv_sec - started->tv_sec) + (finished->tv_nsec - started->tv_nsec) / 1e9;
+
+	fprintf(stream, "real %.3fs user %ld.%03lds sys %ld.%03lds maxrss %ldk csw %ld/%ld\n", real,
+		(long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec / 1000,
+		(long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec / 1000,
+		usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+/*
+ * Print resource usage of the terminated process in the record
+ * 'slot'.
+ *
+*/
+void process_usage(FILE *stream, int slot) {
+	process_t *process = &jobs.slab[slot];
+
+	usage_print(stream, &process->started, &process->finished, &process->usage);
+}
+
+/*
+ * Add resource usage of the terminated foreground 'process' to the
+ * usage of its pipeline. Maximum resident set size is the largest
+ * one of the stages.
+ *
+*/
+void pipeline_usage_add(const process_t *process) {
+	if (! fg_timed) {
+		memset(&fg_usage, 0, sizeof(fg_usage));
+		fg_started = process->started;
+		fg_timed = 1;
+	} else if (process->started.tv_sec < fg_started.tv_sec ||
+		(process->started.tv_sec == fg_started.tv_sec && process->started.tv_nsec < fg_started.tv_nsec))
+	{
+		fg_started = process->started;
+	}
+
+	timeradd(&fg_usage.ru_utime, &process->usage.ru_utime, &fg_usage.ru_utime);
+	timeradd(&fg_usage.ru_stime, &process->usage.ru_stime, &fg_usage.ru_stime);
+
+	if (process->usage.ru_maxrss > fg_usage.ru_maxrss) {
+		fg_usage.ru_maxrss = process->usage.ru_maxrss;
+	}
+
+	fg_usage.ru_nvcsw += process->usage.ru_nvcsw;
+	fg_usage.ru_nivcsw += process->usage.ru_nivcsw;
+}
+
+/*
+ * Print resource usage of a command executed by the shell itself
+ * since 'started', when the shell's usage was 'before'. Maximum
+ * resident set size is the shell's own.
+ *
+*/
+void shell_usage(FILE *stream, const struct timespec *started, const struct rusage *before) {
+	struct timespec finished;
+	struct rusage usage;
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1) {
+		perror("getrusage");
+		return;
+	}
+
+	timersub(&usage.ru_utime, &before->ru_utime, &usage.ru_utime);
+	timersub(&usage.ru_stime, &before->ru_stime, &usage.ru_stime);
+	usage.ru_nvcsw -= before->ru_nvcsw;
+	usage.ru_nivcsw -= before->ru_nivcsw;
+
+	usage_print(stream, started, &finished, &usage);
+}
+
+/*
+ * Reap the terminated process 'pid' and store its exit status
+ * and resource usage. Foreground process is freed right away,
+ * background one is queued until the notification is printed
+ * next time the prompt is displayed.
+ *
+*/
+void process_exited(pid_t pid) {
+	int64_t trace = trace_begin();
+	process_t *process;
+	pid_t w_pid;
+	int status;
+	int slot;
+
+	if ((slot = jobs_find(pid)) == -1) {
+		return;
+	}
+
+	process = &jobs.slab[slot];
+
+	// Unreaped child holds its pid, reaping it by the pid
+	// can't hit another process.
+	if ((w_pid = wait4(pid, &status, WNOHANG, &process->usage)) == -1) {
+		perror("wait4");
+	}
+
+	// Not terminated yet after all.
+	if (w_pid <= 0) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &process->finished);
+
+	if (trace != 0) {
+		trace_record("command", pid, trace_time(&process->started), trace_time(&process->finished));
+		trace_end("reap", trace_pid, trace);
+	}
+
+	if (WIFEXITED(status)) {
+		process->status = WEXITSTATUS(status);
+	} else {
+		process->status = 128 + WTERMSIG(status);
+	}
+
+	// Children being spawned may still hold a copy of the pidfd
+	// for a moment, closing it doesn't remove it from the event loop.
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, process->pidfd, NULL);
+	close(process->pidfd);
+	process->pidfd = -1;
+	process->running = 0;
+
+	if (process->shares_input) {
+		input_sharers--;
+	}
+
+	if (process->cpu != -1) {
+		CPU_CLR(process->cpu, &jobs_cpus_used);
+	}
+
+	if (process->foreground) {
+		if (process->last_stage) {
+			last_status = process->status;
+		}
+
+		if (process->timed) {
+			pipeline_usage_add(process);
+		}
+
+		// Event loop can continue with the next command
+		// once the whole pipeline terminates.
+		if (--fg_processes == 0 && fg_timed) {
+			usage_print(stderr, &fg_started, &process->finished, &fg_usage);
+			fg_timed = 0;
+		}
+
+		process_free(slot);
+		return;
+	}
+
+	jobs_finished_push(slot);
+
+	if (jobs_max > 0) {
+		// Slot is free for the next command.
+		jobs_running--;
+	}
+}
+
+/*
+ * Print notification for each terminated background process, in
+ * order of their termination, followed by their resource usage if
+ * requested, and forget them.
+ * Nothing is printed in non-interactive mode, unless the usage
+ * was requested.
+ *
+*/
+void jobs_notify() {
+	int slot;
+
+	// Print notifications about finished background processes.
+	while ((slot = jobs_finished_pop()) != -1) {
+		if (interactive) {
+			printf("[%d] Finished", jobs.slab[slot].pid);
+
+			if (jobs_timed || jobs.slab[slot].timed) {
+				printf(" ");
+				process_usage(stdout, slot);
+			} else {
+				printf("\n");
+			}
+		} else if (jobs.slab[slot].timed) {
+			fprintf(stderr, "[%d] ", jobs.slab[slot].pid);
+			process_usage(stderr, slot);
+		}
+
+		process_free(slot);
+	}
+}
+
+/*
+ * Display shell's prompt, preceded by notifications about
+ * terminated background processes.
+ *
+*/
+void prompt_show() {
+	jobs_notify();
+
+	if (interactive) {
+		printf("%s", PROMPT);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Classes of characters as seen by the lexer. Classes from
+ * CLASS_SPACE on separate words.
+ *
+*/
+enum {
+	CLASS_WORD,
+	CLASS_SINGLE,
+	CLASS_DOUBLE,
+	CLASS_ESCAPE,
+	CLASS_SUBST,
+	CLASS_SPACE,
+	CLASS_META,
+	CLASS_END,
+	CLASSES,
+};
+
+/*
+ * States of the lexer within a word. States from LEX_DONE on end
+ * the word.
+ *
+*/
+enum {
+	LEX_WORD,
+	LEX_SINGLE,
+	LEX_DOUBLE,
+	LEX_ESCAPE,
+	LEX_DOUBLE_ESCAPE,
+	LEX_DONE,
+	LEX_ERROR,
+	LEX_STATES = LEX_DONE,
+};
+
+/*
+ * What the lexer does with a character.
+ *
+*/
+enum {
+	// Character is part of the word.
+	LEX_COPY,
+	// Character is dropped, it's a quote or an escape.
+	LEX_DROP,
+	// Character is part of the word along with the dropped escape.
+	LEX_KEEP_ESCAPE,
+};
+
+/*
+ * Transition of the lexer.
+ *
+*/
+typedef struct {
+	unsigned char next;
+	unsigned char action;
+} lex_step_t;
+
+// Class of every character; the rest are ordinary characters.
+static const unsigned char char_class[256] = {
+	['\0'] = CLASS_END, ['\n'] = CLASS_END,
+	['\t'] = CLASS_SPACE, ['\v'] = CLASS_SPACE, ['\f'] = CLASS_SPACE, ['\r'] = CLASS_SPACE, [' '] = CLASS_SPACE,
+	['&'] = CLASS_META, ['|'] = CLASS_META, ['<'] = CLASS_META, ['>'] = CLASS_META, [';'] = CLASS_META,
+	['\''] = CLASS_SINGLE, ['"'] = CLASS_DOUBLE, ['\\'] = CLASS_ESCAPE, ['$'] = CLASS_SUBST,
+};
+
+// Transitions of the lexer by its state and class of the character.
+// Single quotes preserve everything, backslash in double quotes
+// escapes only '"', '\' and '$'. Quotes can't span lines.
+static const lex_step_t lex_table[LEX_STATES][CLASSES] = {
+	[LEX_WORD] = {
+		{LEX_WORD, LEX_COPY}, {LEX_SINGLE, LEX_DROP}, {LEX_DOUBLE, LEX_DROP}, {LEX_ESCAPE, LEX_DROP},
+		{LEX_WORD, LEX_COPY}, {LEX_DONE, LEX_COPY}, {LEX_DONE, LEX_COPY}, {LEX_DONE, LEX_COPY},
+	},
+	[LEX_SINGLE] = {
+		{LEX_SINGLE, LEX_COPY}, {LEX_WORD, LEX_DROP}, {LEX_SINGLE, LEX_COPY}, {LEX_SINGLE, LEX_COPY},
+		{LEX_SINGLE, LEX_COPY}, {LEX_SINGLE, LEX_COPY}, {LEX_SINGLE, LEX_COPY}, {LEX_ERROR, LEX_COPY},
+	},
+	[LEX_DOUBLE] = {
+		{LEX_DOUBLE, LEX_COPY}, {LEX_DOUBLE, LEX_COPY}, {LEX_WORD, LEX_DROP}, {LEX_DOUBLE_ESCAPE, LEX_DROP},
+		{LEX_DOUBLE, LEX_COPY}, {LEX_DOUBLE, LEX_COPY}, {LEX_DOUBLE, LEX_COPY}, {LEX_ERROR, LEX_COPY},
+	},
+	[LEX_ESCAPE] = {
+		{LEX_WORD, LEX_COPY}, {LEX_WORD, LEX_COPY}, {LEX_WORD, LEX_COPY}, {LEX_WORD, LEX_COPY},
+		{LEX_WORD, LEX_COPY}, {LEX_WORD, LEX_COPY}, {LEX_WORD, LEX_COPY}, {LEX_ERROR, LEX_COPY},
+	},
+	[LEX_DOUBLE_ESCAPE] = {
+		{LEX_DOUBLE, LEX_KEEP_ESCAPE}, {LEX_DOUBLE, LEX_KEEP_ESCAPE}, {LEX_DOUBLE, LEX_COPY}, {LEX_DOUBLE, LEX_COPY},
+		{LEX_DOUBLE, LEX_COPY}, {LEX_DOUBLE, LEX_KEEP_ESCAPE}, {LEX_DOUBLE, LEX_KEEP_ESCAPE}, {LEX_ERROR, LEX_COPY},
+	},
+};
+
+/*
+ * Check whether the character separates words of a command.
+ *
+*/
+static inline int word_separator(char c) {
+	return char_class[(unsigned char) c] >= CLASS_SPACE;
+}
+
+/*
+ * State of the lexer after the character 'c' in the 'state',
+ * ignoring the ends of words.
+ *
+*/
+static inline int lex_next(int state, char c) {
+	state = lex_table[state][char_class[(unsigned char) c]].next;
+
+	return state >= LEX_DONE ? LEX_WORD : state;
+}
+
+#ifdef __SSE2__
+// True if the CPU supports AVX2, words are scanned 32 bytes at once.
+static int word_avx2 = 0;
+
+/*
+ * Mask of bytes of the 16 bytes at 'str' which separate words, or
+ * which start quotes and escapes as well if 'quotes' is true.
+ *
+*/
+static inline unsigned word_separators_sse2(const char *str, int quotes) {
+	__m128i bytes = _mm_loadu_si128((const __m128i *) str);
+	// White space other than space is '\t' to '\r'.
+	__m128i ws = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+	__m128i found = _mm_cmpeq_epi8(_mm_min_epu8(ws, _mm_set1_epi8('\r' - '\t')), ws);
+
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(RUN_IN_BG)));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(REDIR_OUT)));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(REDIR_IN)));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(PIPE)));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(LIST_SEQ)));
+
+	if (quotes) {
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\'')));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+	}
+
+	return _mm_movemask_epi8(found);
+}
+
+/*
+ * Number of leading 32-byte blocks of 'str' of length 'len' without
+ * a separator, in bytes, plus the position of the first separator
+ * within the next block, if there is one. Quotes and escapes are
+ * treated as separators if 'quotes' is true.
+ *
+*/
+__attribute__((target("avx2")))
+size_t word_len_avx2(const char *str, size_t len, int quotes) {
+	// Quotes are replaced by a separator when they aren't searched for.
+	__m256i single = _mm256_set1_epi8(quotes ? '\'' : ' ');
+	__m256i dbl = _mm256_set1_epi8(quotes ? '"' : ' ');
+	__m256i escape = _mm256_set1_epi8(quotes ? '\\' : ' ');
+	__m256i bytes, ws, found;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		bytes = _mm256_loadu_si256((const __m256i *) &str[i]);
+		ws = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+		found = _mm256_cmpeq_epi8(_mm256_min_epu8(ws, _mm256_set1_epi8('\r' - '\t')), ws);
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_setzero_si256()));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(RUN_IN_BG)));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(REDIR_OUT)));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(REDIR_IN)));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(PIPE)));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(LIST_SEQ)));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, single));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, dbl));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, escape));
+
+		if ((mask = _mm256_movemask_epi8(found)) != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i;
+}
+#endif
+
+/*
+ * Length of the unquoted part of the word at the beginning of 'str'
+ * of length 'len', up to its first separator, or up to its first
+ * quote or escape if 'quotes' is true. Long words are scanned 16
+ * or 32 bytes at once when possible.
+ *
+*/
+static inline size_t word_scan(const char *str, size_t len, int quotes) {
+	unsigned char end = quotes ? CLASS_SINGLE : CLASS_SPACE;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	unsigned mask;
+
+	if (word_avx2 && len >= 32) {
+		i = word_len_avx2(str, len, quotes);
+
+		if (i + 32 <= len) {
+			return i;
+		}
+	}
+
+	for (; i + 16 <= len; i += 16) {
+		if ((mask = word_separators_sse2(&str[i], quotes)) != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	while (i < len && char_class[(unsigned char) str[i]] < end) {
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * Length of the word at the beginning of 'str' of length 'len',
+ * taken literally.
+ *
+*/
+static inline size_t word_len(const char *str, size_t len) {
+	return word_scan(str, len, 0);
+}
+
+/*
+ * Remove quotes and escapes from the word at the beginning of 'str'
+ * of length 'len' and store the rest of the word to 'out', which
+ * may be the 'str' itself. Unquoted part of the word is skipped at
+ * once, the rest is driven by the lexer's table.
+ * Returns length of the word in 'str' and stores length of the
+ * unquoted word to 'out_len'; -1 if a quote or escape isn't closed.
+ *
+*/
+ssize_t word_unquote(const char *str, size_t len, char *out, size_t *out_len) {
+	size_t i = word_scan(str, len, 1);
+	size_t pos = i;
+	int state = LEX_WORD;
+	lex_step_t step;
+
+	if (out != str) {
+		memcpy(out, str, i);
+	}
+
+	for (; i < len; i++) {
+		step = lex_table[state][char_class[(unsigned char) str[i]]];
+
+		if (step.next >= LEX_DONE) {
+			break;
+		}
+
+		// Escape was dropped already, there is room for it.
+		if (step.action == LEX_KEEP_ESCAPE) {
+			out[pos++] = '\\';
+		}
+
+		if (step.action != LEX_DROP) {
+			out[pos++] = str[i];
+		}
+
+		state = step.next;
+	}
+
+	if (state != LEX_WORD) {
+		return -1;
+	}
+
+	*out_len = pos;
+
+	return i;
+}
+
+/*
+ * Report an error of the line being parsed, described by 'format'
+ * followed by its arguments, just as by printf.
+ *
+*/
+void parse_error(const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+
+	if (parse_error_buffer != NULL) {
+		vsnprintf(parse_error_buffer, PARSE_ERROR_SIZE, format, args);
+	} else {
+		vfprintf(stderr, format, args);
+	}
+
+	va_end(args);
+}
+
+/*
+ * Lex the word at position 'start' of the 'line' in place. Quotes
+ * and escapes are removed, the rest of the word is moved over them
+ * and terminated.
+ * Returns position just after the word and stores length of the
+ * lexed word to 'len'; 0 on failure.
+ *
+*/
+size_t word_lex(size_t start, size_t *len) {
+	ssize_t consumed;
+
+	if ((consumed = word_unquote(&line[start], line_len - start, &line[start], len)) == -1) {
+		parse_error("Unterminated quote or escape.\n");
+		return 0;
+	}
+
+	// Separator after the word is terminated by the parser itself.
+	if (*len < (size_t) consumed) {
+		line[start + *len] = '\0';
+	}
+
+	return start + consumed;
+}
+
+/*
+ * Find the first quote or escape in 'str' of length 'len'.
+ * Returns pointer to it; NULL if there is none.
+ *
+*/
+static inline char *quote_find(char *str, size_t len) {
+	static const char quotes[] = {'\'', '"', '\\'};
+	char *first = NULL, *found;
+
+	for (int i = 0; i < 3; i++) {
+		// Search only up to the first one found so far.
+		if ((found = memchr(str, quotes[i], len)) != NULL) {
+			first = found;
+			len = found - str;
+		}
+	}
+
+	return first;
+}
+
+/*
+ * Find delimiter of the first here-document started by '<<' in the
+ * 'line' of length 'len'; '<<' within quotes doesn't start any.
+ * Quotes are removed from the delimiter, the rest of the line
+ * following it is stored to 'rest'.
+ * Returns the delimiter allocated by malloc, its length is stored
+ * in 'delim_len'; NULL if there is no here-document in the line.
+ *
+*/
+char *here_delimiter(char *line, size_t len, size_t *delim_len, char **rest) {
+	char *end = line + len;
+	int state = LEX_WORD;
+	char *redir, *delim;
+	ssize_t raw_len;
+
+	while ((redir = memchr(line, REDIR_IN, end - line)) != NULL) {
+		// Quotes matter only in lines with a redirection. Unquoted
+		// parts are skipped up to the next quote or escape.
+		while (line < redir) {
+			if (state == LEX_WORD && (line = quote_find(line, redir - line)) == NULL) {
+				break;
+			}
+
+			state = lex_next(state, *line++);
+		}
+
+		if (state != LEX_WORD) {
+			state = lex_next(state, *redir);
+			line = redir + 1;
+			continue;
+		}
+
+		if (end - redir < 2 || redir[1] != REDIR_IN) {
+			line = redir + 1;
+			continue;
+		}
+
+		// Here-string.
+		if (end - redir > 2 && redir[2] == REDIR_IN) {
+			line = redir + 3;
+			continue;
+		}
+
+		for (line = redir + 2; line < end && isspace((unsigned char) *line); line++);
+
+		if ((raw_len = word_len(line, end - line)) == 0) {
+			return NULL;
+		}
+
+		if ((delim = malloc(end - line)) == NULL) {
+			perror("malloc");
+			return NULL;
+		}
+
+		// Parser fails on the unclosed quote anyway.
+		if ((raw_len = word_unquote(line, end - line, delim, delim_len)) == -1) {
+			free(delim);
+			return NULL;
+		}
+
+		*rest = line + raw_len;
+
+		return delim;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the end of a here-document's body starting at 'body' in
+ * the reader's buffer, which is the line with the delimiter.
+ * Returns the end of the delimiter's line; NULL if it wasn't read
+ * yet, or the end of data if the input ended before it.
+ *
+*/
+char *reader_here(reader_t *reader, char *body, const char *delim, size_t delim_len) {
+	char *end = reader->data + reader->end;
+	char *line_end;
+
+	while (body < end) {
+		if ((line_end = memchr(body, '\n', end - body)) == NULL) {
+			if (! reader->eof) {
+				return NULL;
+			}
+
+			line_end = end;
+		}
+
+		if ((size_t) (line_end - body) == delim_len && memcmp(body, delim, delim_len) == 0) {
+			return line_end;
+		}
+
+		body = line_end + 1;
+	}
+
+	return reader->eof ? end : NULL;
+}
+
+/*
+ * Read more data into the reader's buffer. Already returned
+ * lines are discarded first, the buffer grows only when it is
+ * full of a single unfinished line. Failure is handled as the
+ * end of input.
+ * Returns number of bytes read, 0 on end of input; -1 on failure.
+ *
+*/
+ssize_t reader_fill(reader_t *reader) {
+	ssize_t num_bytes;
+	char *data;
+
+	if (reader->start > 0) {
+		memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+		reader->scanned -= reader->start;
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+
+	if (reader->end == reader->size) {
+		if ((data = realloc(reader->data, reader->size + READ_SIZE)) == NULL) {
+			perror("realloc");
+			reader->eof = 1;
+			return -1;
+		}
+
+		reader->data = data;
+		reader->size += READ_SIZE;
+	}
+
+	while ((num_bytes = read(reader->fd, reader->data + reader->end, reader->size - reader->end)) == -1) {
+		if (errno != EINTR) {
+			perror("read");
+			reader->eof = 1;
+			return -1;
+		}
+	}
+
+	if (num_bytes == 0) {
+		reader->eof = 1;
+	}
+
+	reader->end += num_bytes;
+
+	return num_bytes;
+}
+
+/*
+ * Get next line from the reader's buffer. Line is terminated by
+ * '\0' instead of the new line symbol and it is valid only until
+ * the reader is filled again. Last line doesn't need the new line
+ * symbol. Line starting here-documents is returned together with
+ * their bodies, which follow the first new line symbol one after
+ * another, each up to the line with its delimiter.
+ * Returns the line, its length is stored in 'len'; NULL if there
+ * is no complete line in the buffer or the input has ended.
+ *
+*/
+char *reader_line(reader_t *reader, size_t *len) {
+	char *line_end = NULL;
+	char *line, *line_cmd_end, *delim, *here_end, *rest;
+	size_t delim_len;
+
+	if (reader->scanned < reader->end) {
+		line_end = memchr(reader->data + reader->scanned, '\n', reader->end - reader->scanned);
+	}
+
+	if (line_end == NULL) {
+		if (! reader->eof || reader->start == reader->end) {
+			// Don't search the same data again.
+			reader->scanned = reader->end;
+			return NULL;
+		}
+
+		// Input was terminated by EOF. There is always a spare
+		// byte for the '\0', the buffer is never filled at EOF.
+		line_end = reader->data + reader->end;
+	}
+
+	line = reader->data + reader->start;
+
+	line_cmd_end = line_end;
+	rest = line;
+
+	// Body of each here-document follows the previous one's.
+	while (line_end < reader->data + reader->end && memchr(rest, REDIR_IN, line_cmd_end - rest) != NULL &&
+		(delim = here_delimiter(rest, line_cmd_end - rest, &delim_len, &rest)) != NULL)
+	{
+		here_end = reader_here(reader, line_end + 1, delim, delim_len);
+		free(delim);
+
+		if (here_end == NULL) {
+			// Find the same line once more data are read.
+			reader->scanned = line_cmd_end - reader->data;
+			return NULL;
+		}
+
+		line_end = here_end;
+	}
+
+	*line_end = '\0';
+	*len = line_end - line;
+	reader->start = (line_end - reader->data) + (line_end < reader->data + reader->end);
+	reader->scanned = reader->start;
+
+	return line;
+}
+
+/*
+ * Return the 'line' of length 'len', just taken by reader_line(),
+ * back to the reader, so it is taken once more next time.
+ *
+*/
+void reader_unread(reader_t *reader, char *line, size_t len) {
+	// Line's terminator replaced its new line, if there was any.
+	if (line + len < reader->data + reader->end) {
+		line[len] = '\n';
+	}
+
+	reader->start = reader->scanned = line - reader->data;
+}
+
+/*
+ * Use contents of the file 'path' as reader's input. Regular file
+ * is mapped into memory privately, lines are parsed directly
+ * in the mapping. Pages are copied by the kernel only once they
+ * are modified by the parser.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int reader_map(reader_t *reader, const char *path) {
+	struct stat info;
+	void *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "Couldn't open file '%s'.\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &info) == -1) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	// Pipes and such can't be mapped, just read them.
+	if (! S_ISREG(info.st_mode)) {
+		reader->fd = fd;
+		return 0;
+	}
+
+	// Reserve one more byte for terminating the last line, then
+	// map the file over the beginning of the reservation.
+	if ((data = mmap(NULL, info.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED ||
+		(info.st_size > 0 && mmap(data, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED))
+	{
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	madvise(data, info.st_size + 1, MADV_SEQUENTIAL);
+
+	reader->data = data;
+	reader->size = info.st_size + 1;
+	reader->start = 0;
+	reader->end = info.st_size;
+	// Whole input is available.
+	reader->eof = 1;
+
+	return 0;
+}
+
+/*
+ * Use the string 'str' as reader's input. String is parsed in-situ.
+ *
+*/
+void reader_string(reader_t *reader, char *str) {
+	reader->data = str;
+	reader->end = strlen(str);
+	// Includes the string's terminator.
+	reader->size = reader->end + 1;
+	reader->start = 0;
+	reader->eof = 1;
+}
+
+/*
+ * Take the next line of user's input and store it in the 'line'.
+ * Returns 0 on success; -1 if more input has to be read first.
+ *
+*/
+int input_read() {
+	static char exit_line[] = "exit";
+	int64_t trace = trace_begin();
+
+	if ((line = reader_line(&input, &line_len)) == NULL) {
+		if (! input.eof) {
+			return -1;
+		}
+
+		// Handle EOF just as if the user entered 'exit' command.
+		line = exit_line;
+		line_len = strlen(exit_line);
+
+		if (interactive) {
+			printf("%s\n", line);
+		}
+	} else if (interactive && input.eof && input.start == input.end) {
+		// Input was terminated by EOF, not by new line.
+		printf("\n");
+	}
+
+	trace_end("read", trace_pid, trace);
+
+	return 0;
+}
+
+/*
+ * Handle SIGINT signals received through the signalfd.
+ *
+*/
+void signals_handle() {
+	struct signalfd_siginfo info[SIGNALS_SIZE];
+	ssize_t num_bytes;
+
+	if ((num_bytes = read(signal_fd, info, sizeof(info))) == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("read");
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < num_bytes / sizeof(info[0]); i++) {
+		if (info[i].ssi_signo == SIGINT) {
+			printf("\n");
+
+			if (fg_processes > 0) {
+				// Pass it the foreground processes. Shell keeps running.
+				for (int slot = 0; slot < jobs.size; slot++) {
+					if (jobs.slab[slot].pid != 0 && jobs.slab[slot].foreground && jobs.slab[slot].running) {
+						pidfd_send_signal(jobs.slab[slot].pidfd, SIGINT, NULL, 0);
+					}
+				}
+			} else {
+				// User is just playing with the keyboard.
+				prompt_show();
+			}
+		}
+	}
+}
+
+/*
+ * Wait for the next events and handle them. Input is read only
+ * if 'want_input' is true, it's left for the foreground process
+ * otherwise. Waits at most 'timeout' milliseconds, -1 means
+ * no limit.
+ *
+*/
+void events_wait(int want_input, int timeout) {
+	struct epoll_event events[EVENTS_SIZE];
+	struct epoll_event event;
+	int64_t trace;
+	int num_events;
+
+	if (want_input && input_polled && ! input_armed) {
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.u64 = EVENT_INPUT;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, input.fd, &event) == -1) {
+			perror("epoll_ctl");
+			input.eof = 1;
+			return;
+		}
+
+		input_armed = 1;
+	}
+
+	trace = trace_begin();
+	num_events = epoll_wait(epoll_fd, events, EVENTS_SIZE, timeout);
+	trace_end("wait", trace_pid, trace);
+
+	if (num_events == -1) {
+		if (errno != EINTR) {
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		return;
+	}
+
+	for (int i = 0; i < num_events; i++) {
+		if (events[i].data.u64 == EVENT_SIGNAL) {
+			signals_handle();
+		} else if (events[i].data.u64 == EVENT_INPUT) {
+			// Disarmed until requested again.
+			input_armed = 0;
+
+			if (want_input) {
+				reader_fill(&input);
+			}
+		} else {
+			// Only tracked processes are left.
+			process_exited(events[i].data.u64);
+		}
+	}
+}
+
+/*
+ * Set up the event loop. SIGINT in the 'mask' has to be
+ * blocked already.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int events_init(sigset_t *mask) {
+	struct epoll_event event;
+
+	if ((signal_fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		perror("signalfd");
+		return -1;
+	}
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = EVENT_SIGNAL;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	// Mapped scripts and strings are complete already.
+	if (input.eof) {
+		return 0;
+	}
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.u64 = EVENT_INPUT;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input.fd, &event) == -1) {
+		if (errno != EPERM) {
+			perror("epoll_ctl");
+			return -1;
+		}
+
+		// Regular file, reading it never blocks for long.
+		return 0;
+	}
+
+	input_polled = 1;
+	input_armed = 1;
+
+	return 0;
+}
+
+/*
+ * Split 'body' of length 'len' among the here-documents of a line
+ * in order. Each gets the lines up to its delimiter, the last ones
+ * get what is left once input ends before the delimiter.
+ *
+*/
+void command_here_bodies(here_doc_t *here, char *body, size_t len) {
+	char *end = body + len;
+	char *line, *line_end, *next;
+
+	for (; here != NULL; here = here->next) {
+		next = end;
+
+		for (line = body; line < end; line = next) {
+			if ((line_end = memchr(line, '\n', end - line)) == NULL) {
+				line_end = end;
+			}
+
+			next = line_end + (line_end < end);
+
+			if ((size_t) (line_end - line) == here->delim_len && memcmp(line, here->delim, here->delim_len) == 0) {
+				break;
+			}
+		}
+
+		here->command->here = body;
+		here->command->here_len = line - body;
+		body = line < end ? next : end;
+	}
+}
+
+/*
+ * Check whether nothing was parsed for the command, neither a name
+ * of the program to execute nor a redirection.
+ *
+*/
+static inline int command_empty(const command_t *command) {
+	return command->args[0] == NULL && command->in == NULL && command->here == NULL && command->out == NULL &&
+		command->next == NULL;
+}
+
+/*
+ * Find the end of a substitution starting at position 'start'
+ * of the 'line', which is the matching closing parenthesis.
+ * Substitution has to be a whole argument.
+ * Returns position of the end; 0 on failure.
+ *
+*/
+size_t command_subst_end(size_t start) {
+	int state = LEX_WORD;
+	int depth = 0;
+
+	for (size_t i = start + 1; i < line_len && line[i] != '\n'; i++) {
+		// Parentheses within quotes are just characters.
+		if (state != LEX_WORD) {
+			state = lex_next(state, line[i]);
+		} else if (line[i] == SUBST_OPEN) {
+			depth++;
+		} else if (line[i] == SUBST_CLOSE && --depth == 0) {
+			if (i + 1 < line_len && ! word_separator(line[i + 1])) {
+				parse_error("Substitution has to be a whole argument.\n");
+				return 0;
+			}
+
+			return i;
+		} else {
+			state = lex_next(state, line[i]);
+		}
+	}
+
+	parse_error("Missing '%c' of a substitution.\n", SUBST_CLOSE);
+	return 0;
+}
+
+/*
+ * Start a new stage of the command's pipeline. Its array of
+ * arguments is allocated from the 'arena'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int command_stage(command_t *command, arena_t *arena) {
+	if ((command->args = arena_alloc(arena, ARGS_SIZE * sizeof(char *))) == NULL) {
+		return -1;
+	}
+
+	command->run_in_bg = 0;
+	command->out = NULL;
+	command->in = NULL;
+	command->here = NULL;
+	command->here_len = 0;
+	command->timed = 0;
+	command->substitutions = NULL;
+	command->sched = NULL;
+	command->next = NULL;
+	command->list_next = NULL;
+	command->list_op = '\0';
+
+	return 0;
+}
+
+/*
+ * Parse an user's command stored in the 'line'. Arguments
+ * and other information is stored in the 'command', stages
+ * of a pipeline following the first one are chained to it.
+ * Parsing is done in-situ in the 'line', arrays of arguments
+ * and the stages are allocated from the 'arena'.
+ * Returns 0 on success; -1 otherwise.
+ *
+ * WARNING: Modifies contents of the 'line'!
+ *
+*/
+int command_parse(command_t *command, arena_t *arena) {
+	size_t args_size = ARGS_SIZE;
+	command_t *stage = command;
+	// First stage of the current command of the list.
+	command_t *element = command;
+	command_t *next;
+	// Here-documents of the line, bodies follow its end.
+	here_doc_t *heres = NULL;
+	here_doc_t **here_tail = &heres;
+	here_doc_t *here;
+	size_t len;
+	// Where the next substitution of the stage is appended.
+	substitution_t **subst_tail = &command->substitutions;
+	substitution_t *subst;
+	char *outer_line;
+	size_t outer_len, end;
+	int result;
+	char token = '\0', op;
+	int ignore = 0;
+	size_t pos = 0;
+	char **args;
+
+	if (command_stage(command, arena) != 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < line_len; i++) {
+		// Only a here-document's body follows.
+		if (line[i] == '\n') {
+			line[i] = '\0';
+			command_here_bodies(heres, &line[i + 1], line_len - i - 1);
+			break;
+		}
+
+		if (isspace((unsigned char) line[i]) || line[i] == '\0') {
+			// Preemptive string termination.
+			line[i] = '\0';
+			ignore = 0;
+			continue;
+		}
+
+		// Pipe or an operator of a list, both end the stage.
+		if (line[i] == PIPE || line[i] == RUN_IN_BG || line[i] == LIST_SEQ) {
+			op = line[i];
+
+			if (op != LIST_SEQ && i + 1 < line_len && line[i + 1] == op) {
+				op = op == PIPE ? LIST_OR : LIST_AND;
+				line[i++] = '\0';
+			}
+
+			// Whole pipeline runs in background.
+			if (op == RUN_IN_BG) {
+				element->run_in_bg = 1;
+			}
+
+			line[i] = '\0';
+			ignore = 0;
+			token = '\0';
+
+			// NULL-terminate arguments of the finished stage.
+			while (pos < args_size) {
+				stage->args[pos++] = NULL;
+			}
+
+			if ((next = arena_alloc(arena, sizeof(command_t))) == NULL || command_stage(next, arena) != 0) {
+				return -1;
+			}
+
+			if (op == PIPE) {
+				stage->next = next;
+			} else {
+				element->list_next = next;
+				element->list_op = op == RUN_IN_BG ? LIST_SEQ : op;
+				element = next;
+			}
+
+			stage = next;
+			subst_tail = &stage->substitutions;
+			args_size = ARGS_SIZE;
+			pos = 0;
+			continue;
+		}
+
+		if (line[i] == REDIR_OUT || line[i] == REDIR_IN) {
+			// Store the token and terminate previous argument.
+			token = line[i];
+			line[i] = '\0';
+			ignore = 0;
+
+			if (token == REDIR_IN && i + 1 < line_len && line[i + 1] == REDIR_IN) {
+				token = REDIR_HERE_DOC;
+				line[++i] = '\0';
+
+				if (i + 1 < line_len && line[i + 1] == REDIR_IN) {
+					token = REDIR_HERE_STR;
+					line[++i] = '\0';
+				}
+			}
+
+			continue;
+		}
+
+		// Here-document's delimiter or here-string, which gets
+		// a new line appended. Both end the redirection.
+		// Quotes are removed from the delimiter, just as by the
+		// reader.
+		if (token == REDIR_HERE_DOC || token == REDIR_HERE_STR) {
+			if (token == REDIR_HERE_DOC) {
+				if ((end = word_lex(i, &len)) == 0 || (here = arena_alloc(arena, sizeof(here_doc_t))) == NULL) {
+					return -1;
+				}
+
+				here->command = stage;
+				here->delim = &line[i];
+				here->delim_len = len;
+				here->next = NULL;
+				*here_tail = here;
+				here_tail = &here->next;
+			} else {
+				if ((end = word_lex(i, &len)) == 0 || (stage->here = arena_alloc(arena, len + 1)) == NULL) {
+					return -1;
+				}
+
+				memcpy(stage->here, &line[i], len);
+				stage->here[len] = '\n';
+				stage->here_len = len + 1;
+			}
+
+			token = '\0';
+			i = end - 1;
+			continue;
+		}
+
+		// Argument's beginning. Just store pointer to the line.
+		if (! ignore) {
+			if (token != REDIR_IN && token != REDIR_OUT && line[i] == SUBST && i + 1 < line_len &&
+				line[i + 1] == SUBST_OPEN)
+			{
+				if ((end = command_subst_end(i)) == 0) {
+					return -1;
+				}
+
+				if ((subst = arena_alloc(arena, sizeof(substitution_t))) == NULL ||
+					(subst->command = arena_alloc(arena, sizeof(command_t))) == NULL)
+				{
+					return -1;
+				}
+
+				// Parse the inner command in-situ as well.
+				outer_line = line;
+				outer_len = line_len;
+				line = &outer_line[i + 2];
+				line_len = end - i - 2;
+				outer_line[end] = '\0';
+				result = command_parse(subst->command, arena);
+				line = outer_line;
+				line_len = outer_len;
+
+				if (result != 0) {
+					return -1;
+				}
+
+				if (subst->command->list_next != NULL) {
+					parse_error("Substitution can't contain a list of commands.\n");
+					return -1;
+				}
+
+				subst->pos = pos;
+				subst->next = NULL;
+				*subst_tail = subst;
+				subst_tail = &subst->next;
+
+				// Placeholder, replaced before the command runs.
+				stage->args[pos++] = &line[i];
+				i = end;
+			} else {
+				// Whole argument is lexed at once.
+				if ((end = word_lex(i, &len)) == 0) {
+					return -1;
+				}
+
+				if (token == REDIR_IN) {
+					stage->in = &line[i];
+				} else if (token == REDIR_OUT) {
+					stage->out = &line[i];
+				} else {
+					stage->args[pos++] = &line[i];
+				}
+
+				i = end - 1;
+			}
+
+			ignore = 1;
+		}
+
+		if (args_size <= pos) {
+			// Previous array is left in the arena, it's freed with it.
+			if ((args = arena_alloc(arena, 2 * args_size * sizeof(char *))) == NULL) {
+				return -1;
+			}
+
+			memcpy(args, stage->args, args_size * sizeof(char *));
+			stage->args = args;
+			args_size <<= 1;
+		}
+	}
+
+	// NULL-terminate arguments.
+	while (pos < args_size) {
+		stage->args[pos++] = NULL;
+	}
+
+	// Both sides of '&&' and '||' are needed, unlike of ';'.
+	for (element = command; element->list_next != NULL; element = element->list_next) {
+		if (element->list_op != LIST_SEQ && (command_empty(element) || command_empty(element->list_next))) {
+			parse_error("Missing command in list.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * FNV-1a hash of the command's name.
+ *
+*/
+static inline unsigned path_hash(const char *name) {
+	unsigned hash = 2166136261u;
+
+	while (*name != '\0') {
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	}
+
+	return hash % PATH_CACHE_SIZE;
+}
+
+/*
+ * Forget all resolved executables.
+ *
+*/
+void path_cache_clear() {
+	path_entry_t *entry;
+
+	for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+		while ((entry = path_cache[i]) != NULL) {
+			path_cache[i] = entry->next;
+			path_entry_free(entry);
+		}
+	}
+
+	free(path_cache_env);
+	path_cache_env = NULL;
+}
+
+/*
+ * Forget resolved executable of the command 'name'.
+ *
+*/
+void path_cache_invalidate(const char *name) {
+	path_entry_t **entry = &path_cache[path_hash(name)];
+	path_entry_t *old_entry;
+
+	while (*entry != NULL) {
+		if (strcmp((*entry)->name, name) == 0) {
+			old_entry = *entry;
+			*entry = old_entry->next;
+			path_entry_free(old_entry);
+			return;
+		}
+
+		entry = &(*entry)->next;
+	}
+}
+
+/*
+ * Forget resolved executables whose path is relative, found
+ * through relative directories in the PATH. They are no longer
+ * valid once the working directory changes.
+ *
+*/
+void path_cache_forget_relative() {
+	path_entry_t **entry;
+	path_entry_t *old_entry;
+
+	for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+		entry = &path_cache[i];
+
+		while (*entry != NULL) {
+			if ((*entry)->path[0] != '/') {
+				old_entry = *entry;
+				*entry = old_entry->next;
+				path_entry_free(old_entry);
+			} else {
+				entry = &(*entry)->next;
+			}
+		}
+	}
+}
+
+/*
+ * Search directories in the PATH for an executable 'name'.
+ * Empty directory stands for the current working directory.
+ * Returns newly allocated path of the executable; NULL if
+ * there is no such executable.
+ *
+*/
+char *path_search(const char *name, const char *env) {
+	size_t name_len = strlen(name);
+	const char *dir = env;
+	const char *dir_end;
+	struct stat info;
+	size_t dir_len;
+	char *path;
+
+	while (1) {
+		if ((dir_end = strchr(dir, ':')) == NULL) {
+			dir_end = dir + strlen(dir);
+		}
+
+		dir_len = dir_end - dir;
+
+		if ((path = malloc(dir_len + name_len + 3)) == NULL) {
+			perror("malloc");
+			return NULL;
+		}
+
+		if (dir_len == 0) {
+			strcpy(path, ".");
+			dir_len = 1;
+		} else {
+			memcpy(path, dir, dir_len);
+		}
+
+		path[dir_len] = '/';
+		strcpy(path + dir_len + 1, name);
+
+		if (stat(path, &info) == 0 && S_ISREG(info.st_mode) && access(path, X_OK) == 0) {
+			return path;
+		}
+
+		free(path);
+
+		if (*dir_end == '\0') {
+			return NULL;
+		}
+
+		dir = dir_end + 1;
+	}
+}
+
+/*
+ * Find an executable for the command 'name', similar to execvp.
+ * Results of the PATH search are cached until the PATH changes.
+ * Names containing a slash are used as they are.
+ * Returns path of the executable, owned by the cache; NULL if
+ * there is no such executable.
+ *
+*/
+const char *path_lookup(const char *name) {
+	const char *env = getenv("PATH");
+	path_entry_t *entry;
+	unsigned hash;
+	char *path;
+
+	if (strchr(name, '/') != NULL) {
+		return name;
+	}
+
+	if (env == NULL) {
+		env = DEFAULT_PATH;
+	}
+
+	// Entries resolved with a different PATH may be stale.
+	if (path_cache_env == NULL || strcmp(path_cache_env, env) != 0) {
+		path_cache_clear();
+
+		if ((path_cache_env = strdup(env)) == NULL) {
+			perror("strdup");
+			return NULL;
+		}
+	}
+
+	hash = path_hash(name);
+
+	for (entry = path_cache[hash]; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->name, name) == 0) {
+			entry->hits++;
+			return entry->path;
+		}
+	}
+
+	if ((path = path_search(name, env)) == NULL) {
+		return NULL;
+	}
+
+	if ((entry = malloc(sizeof(path_entry_t))) == NULL || (entry->name = strdup(name)) == NULL) {
+		perror("malloc");
+		free(entry);
+		free(path);
+		return NULL;
+	}
+
+	entry->path = path;
+	entry->hits = 1;
+	entry->next = path_cache[hash];
+	path_cache[hash] = entry;
+
+	return entry->path;
+}
+
+/*
+ * Open the file the command's stdout should be redirected to.
+ * The descriptor is opened with close-on-exec flag, only its
+ * duplicate is inherited by the command.
+ * Returns the opened descriptor, STDOUT_FILENO if there is no
+ * redirection; -1 on failure.
+ *
+*/
+int command_redirect_out(command_t *command) {
+	static mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+	static int flags = O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC;
+	int fd;
+
+	if (command->out == NULL) {
+		return STDOUT_FILENO;
+	}
+
+	if ((fd = open(command->out, flags, mode)) == -1) {
+		fprintf(stderr, "Couldn't open file '%s'.\n", command->out);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Store the command's here-document or here-string in memory.
+ * Small one is written into a pipe, larger one into an anonymous
+ * memory-backed file, no file is created on disk.
+ * Returns descriptor the data can be read from; -1 on failure.
+ *
+*/
+int command_redirect_here(command_t *command) {
+	size_t len = command->here_len;
+	char *data = command->here;
+	int fd_pipe[2];
+	ssize_t num_bytes;
+	int fd;
+
+	if (len <= PIPE_BUF) {
+		if (pipe2(fd_pipe, O_CLOEXEC) == -1) {
+			perror("pipe2");
+			return -1;
+		}
+
+		// Fits into the pipe's buffer, writing can't block.
+		if (len > 0 && write(fd_pipe[1], data, len) != (ssize_t) len) {
+			perror("write");
+			close(fd_pipe[0]);
+			close(fd_pipe[1]);
+			return -1;
+		}
+
+		close(fd_pipe[1]);
+
+		return fd_pipe[0];
+	}
+
+	if ((fd = memfd_create("here-document", MFD_CLOEXEC)) == -1) {
+		perror("memfd_create");
+		return -1;
+	}
+
+	while (len > 0) {
+		if ((num_bytes = write(fd, data, len)) == -1) {
+			perror("write");
+			close(fd);
+			return -1;
+		}
+
+		data += num_bytes;
+		len -= num_bytes;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Open the file the command's stdin should be redirected from,
+ * or the command's here-document.
+ * The descriptor is opened with close-on-exec flag, only its
+ * duplicate is inherited by the command.
+ * Returns the opened descriptor, STDIN_FILENO if there is no
+ * redirection; -1 on failure.
+ *
+*/
+int command_redirect_in(command_t *command) {
+	int fd;
+
+	if (command->here != NULL) {
+		return command_redirect_here(command);
+	}
+
+	if (command->in == NULL) {
+		return STDIN_FILENO;
+	}
+
+	if ((fd = open(command->in, O_RDONLY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "Couldn't open file '%s'.\n", command->in);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Signal mask the command's process should start with.
+ *
+*/
+static inline void command_sigmask(command_t *command, sigset_t *mask) {
+	sigemptyset(mask);
+
+	// Background commands ignore SIGINT sent to the foreground one.
+	if (command->run_in_bg) {
+		sigaddset(mask, SIGINT);
+	}
+}
+
+/*
+ * Parse list of CPUs such as '0-3,8' into 'cpus'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int sched_parse_cpus(const char *str, cpu_set_t *cpus) {
+	long first, last;
+	char *end;
+
+	CPU_ZERO(cpus);
+
+	do {
+		first = last = strtol(str, &end, 10);
+
+		if (end != str && *end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+		}
+
+		if (end == str || first < 0 || last < first || last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+			return -1;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, cpus);
+		}
+
+		str = end + 1;
+	} while (*end == ',');
+
+	return 0;
+}
+
+/*
+ * Parse scheduling policy 'other', 'batch', 'idle', 'fifo:PRIORITY'
+ * or 'rr:PRIORITY' into the 'sched'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int sched_parse_policy(const char *str, sched_t *sched) {
+	static const char *names[] = {"other", "batch", "idle", "fifo", "rr"};
+	static const int policies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR};
+	size_t len = strcspn(str, ":");
+	char *end;
+
+	for (int i = 0; i < 5; i++) {
+		if (strlen(names[i]) != len || strncmp(str, names[i], len) != 0) {
+			continue;
+		}
+
+		sched->policy = policies[i];
+		sched->priority = 0;
+
+		// Only real-time policies have a priority.
+		if (sched->policy == SCHED_FIFO || sched->policy == SCHED_RR) {
+			if (str[len] != ':') {
+				return -1;
+			}
+
+			sched->priority = strtol(str + len + 1, &end, 10);
+
+			return *end == '\0' && end != str + len + 1 ? 0 : -1;
+		}
+
+		return str[len] == '\0' ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Parse I/O priority class 'rt', 'be' or 'idle', optionally followed
+ * by ':LEVEL', into the 'sched'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int sched_parse_ioprio(const char *str, sched_t *sched) {
+	static const char *names[] = {"rt", "be", "idle"};
+	static const int classes[] = {IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE};
+	size_t len = strcspn(str, ":");
+	long level = 0;
+	char *end;
+
+	for (int i = 0; i < 3; i++) {
+		if (strlen(names[i]) != len || strncmp(str, names[i], len) != 0) {
+			continue;
+		}
+
+		if (str[len] == ':') {
+			level = strtol(str + len + 1, &end, 10);
+
+			if (*end != '\0' || end == str + len + 1 || level < 0 || level >= IOPRIO_NR_LEVELS) {
+				return -1;
+			}
+		} else if (str[len] != '\0') {
+			return -1;
+		}
+
+		sched->ioprio = IOPRIO_PRIO_VALUE(classes[i], level);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Set up scheduling of the calling process, the command's child.
+ * Returns 0 on success; -1 otherwise with errno set.
+ *
+*/
+int sched_apply(const sched_t *sched) {
+	struct sched_param param = {sched->priority};
+
+	if (sched->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &sched->cpus) == -1) {
+		return -1;
+	}
+
+	if (sched->policy != -1 && sched_setscheduler(0, sched->policy, &param) == -1) {
+		return -1;
+	}
+
+	if (sched->has_nice && setpriority(PRIO_PROCESS, 0, sched->nice) == -1) {
+		return -1;
+	}
+
+	if (sched->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched->ioprio) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a CPU of the shell not used by any running command and pin
+ * the command to it, along with the rest of its pipeline.
+ * Returns the CPU; -1 if all of them are used.
+ *
+*/
+int sched_pin(command_t *command) {
+	sched_t *sched;
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &jobs_cpus) && ! CPU_ISSET(cpu, &jobs_cpus_used)) {
+			break;
+		}
+	}
+
+	if (cpu == CPU_SETSIZE || (sched = arena_alloc(&run_arena, sizeof(sched_t))) == NULL) {
+		return -1;
+	}
+
+	// Stages of a pipeline may share the scheduling.
+	if (command->sched != NULL) {
+		*sched = *command->sched;
+	} else {
+		sched->has_nice = 0;
+		sched->policy = -1;
+		sched->ioprio = -1;
+	}
+
+	sched->has_cpus = 1;
+	CPU_ZERO(&sched->cpus);
+	CPU_SET(cpu, &sched->cpus);
+	CPU_SET(cpu, &jobs_cpus_used);
+	sched->cpu = cpu;
+	command->sched = sched;
+
+	return cpu;
+}
+
+/*
+ * Make sure no descriptor above stderr is inherited by the command
+ * executed in a forked child, not to keep pipes of other commands
+ * open. Descriptors are only marked close-on-exec, so the pipe
+ * reporting exec failure stays open until the exec. Where
+ * close_range isn't available, descriptors listed in /proc are
+ * marked one by one.
+ *
+*/
+void command_close_fds() {
+	struct dirent *entry;
+	DIR *dir;
+	int fd;
+
+#ifdef CLOSE_RANGE_CLOEXEC
+	if (close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+		return;
+	}
+#endif
+
+	if ((dir = opendir("/proc/self/fd")) == NULL) {
+		for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if ((fd = atoi(entry->d_name)) > STDERR_FILENO && fd != dirfd(dir)) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	closedir(dir);
+}
+
+#ifdef SPAWN_CLOSEFROM
+/*
+ * Launch the command's executable 'path' using posix_spawn.
+ * Redirections are done by the spawn's file actions, signal
+ * mask is set by its attributes. Descriptors above stderr are
+ * closed by the file actions as well.
+ * Returns pid of the new process on success; -1 otherwise
+ * with errno set to the cause of the failure.
+ *
+*/
+pid_t command_launch_spawn(command_t *command, const char *path, int fd_in, int fd_out) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t c_pid;
+	int error;
+
+	if ((error = posix_spawn_file_actions_init(&actions)) != 0) {
+		errno = error;
+		return -1;
+	}
+
+	if ((error = posix_spawnattr_init(&attr)) != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		errno = error;
+		return -1;
+	}
+
+	command_sigmask(command, &mask);
+
+	if ((fd_in != STDIN_FILENO && (error = posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO)) != 0) ||
+		(fd_out != STDOUT_FILENO && (error = posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO)) != 0) ||
+		(error = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1)) != 0 ||
+		(error = posix_spawnattr_setsigmask(&attr, &mask)) != 0 ||
+		(error = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK)) != 0 ||
+		// Failed exec is reported back to the parent.
+		(error = posix_spawn(&c_pid, path, &actions, &attr, command->args, environ)) != 0)
+	{
+		c_pid = -1;
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	errno = error;
+
+	return c_pid;
+}
+#endif
+
+/*
+ * Launch the command's executable 'path' using plain fork.
+ * Redirections and signal mask are set up by the child before
+ * exec. Failed exec is reported back to the parent through
+ * a close-on-exec pipe, just like posix_spawn does.
+ * Returns pid of the new process on success; -1 otherwise
+ * with errno set to the cause of the failure.
+ *
+*/
+pid_t command_launch_fork(command_t *command, const char *path, int fd_in, int fd_out) {
+	ssize_t num_bytes;
+	int fd_err[2];
+	pid_t c_pid;
+	int error;
+
+	if (pipe(fd_err) == -1) {
+		return -1;
+	}
+
+	if (fcntl(fd_err[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fd_err[1], F_SETFD, FD_CLOEXEC) == -1 ||
+		(c_pid = fork()) < 0)
+	{
+		error = errno;
+		close(fd_err[0]);
+		close(fd_err[1]);
+		errno = error;
+		return -1;
+	}
+
+	// Child process.
+	if (c_pid == 0) {
+		sigset_t mask;
+
+		// Redirect process' stdout and stdin, if requested by the command.
+		if ((fd_out != STDOUT_FILENO && dup2(fd_out, STDOUT_FILENO) == -1) ||
+			(fd_in != STDIN_FILENO && dup2(fd_in, STDIN_FILENO) == -1))
+		{
+			error = errno;
+		} else if (command->sched != NULL && sched_apply(command->sched) != 0) {
+			error = errno;
+		} else {
+			command_close_fds();
+
+			// Unblock signals blocked by the shell.
+			command_sigmask(command, &mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+
+			// Will return only when error occurred.
+			execv(path, command->args);
+			error = errno;
+		}
+
+		if (write(fd_err[1], &error, sizeof(error)) != sizeof(error)) {
+			perror("write");
+		}
+
+		// Don't flush stdio buffers copied from the shell.
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fd_err[1]);
+
+	// Closed without any data on successful exec.
+	while ((num_bytes = read(fd_err[0], &error, sizeof(error))) == -1 && errno == EINTR);
+	close(fd_err[0]);
+
+	if (num_bytes == sizeof(error)) {
+		waitpid(c_pid, NULL, 0);
+		errno = error;
+		return -1;
+	}
+
+	return c_pid;
+}
+
+/*
+ * Make sure the buffer has room for at least 'size' more bytes.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int buffer_reserve(buffer_t *buffer, size_t size) {
+	size_t new_size = buffer->size == 0 ? READ_SIZE : buffer->size;
+	char *data;
+
+	while (new_size - buffer->len < size) {
+		new_size <<= 1;
+	}
+
+	if (new_size != buffer->size) {
+		if ((data = realloc(buffer->data, new_size)) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+
+		buffer->data = data;
+		buffer->size = new_size;
+	}
+
+	return 0;
+}
+
+/*
+ * Append the null-terminated string 'str' to the buffer.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int buffer_append(buffer_t *buffer, const char *str) {
+	size_t len = strlen(str) + 1;
+
+	if (buffer_reserve(buffer, len) != 0) {
+		return -1;
+	}
+
+	memcpy(buffer->data + buffer->len, str, len);
+	buffer->len += len;
+
+	return 0;
+}
+
+/*
+ * Handle a launch request received by the zygote in 'data' of size
+ * 'size', with descriptors 'fds' for the command's stdin and stdout.
+ * The command is forked as a child of the shell, so the shell tracks
+ * it just like the ones it launched itself. Zygote waits for the exec,
+ * failure is reported back through a close-on-exec pipe.
+ * Returns the reply for the shell.
+ *
+*/
+zygote_reply_t zygote_launch(char *data, size_t size, int fds[2]) {
+	zygote_request_t request;
+	zygote_reply_t reply = {-1, EINVAL};
+	command_t command;
+	char **args, *path, *end = data + size;
+	ssize_t num_bytes;
+	int fd_err[2];
+	int error;
+
+	memcpy(&request, data, sizeof(request));
+	path = data + sizeof(request);
+
+	if (request.chdir) {
+		if (chdir(path) == -1) {
+			reply.error = errno;
+			return reply;
+		}
+
+		path += strlen(path) + 1;
+	}
+
+	if (request.argc < 1 || request.envc < 0 ||
+		(args = malloc((request.argc + request.envc + 2) * sizeof(char *))) == NULL)
+	{
+		return reply;
+	}
+
+	// Arguments, then environment, each terminated by NULL.
+	data = path + strlen(path) + 1;
+
+	for (int i = 0; i < request.argc + request.envc + 1; i++) {
+		if (i == request.argc) {
+			args[i] = NULL;
+			continue;
+		}
+
+		if (data >= end) {
+			free(args);
+			return reply;
+		}
+
+		args[i] = data;
+		data += strlen(data) + 1;
+	}
+
+	args[request.argc + request.envc + 1] = NULL;
+
+	if (pipe2(fd_err, O_CLOEXEC) == -1) {
+		reply.error = errno;
+		free(args);
+		return reply;
+	}
+
+	// Fork with the shell as the parent.
+	if ((reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0)) == 0) {
+		sigset_t mask;
+
+		if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(fds[1], STDOUT_FILENO) == -1) {
+			error = errno;
+		} else {
+			command_clear(&command);
+			command.run_in_bg = request.run_in_bg;
+			command_close_fds();
+			command_sigmask(&command, &mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+
+			// Will return only when error occurred.
+			execve(path, args, args + request.argc + 1);
+			error = errno;
+		}
+
+		if (write(fd_err[1], &error, sizeof(error)) != sizeof(error)) {
+			perror("write");
+		}
+
+		_exit(EXIT_FAILURE);
+	}
+
+	reply.error = errno;
+	close(fd_err[1]);
+	free(args);
+
+	if (reply.pid != -1) {
+		// Closed without any data on successful exec.
+		while ((num_bytes = read(fd_err[0], &error, sizeof(error))) == -1 && errno == EINTR);
+
+		// Failed child is reaped by the shell.
+		reply.error = num_bytes == sizeof(error) ? error : 0;
+	}
+
+	close(fd_err[0]);
+
+	return reply;
+}
+
+/*
+ * Main loop of the zygote. Requests are received one by one until
+ * the shell closes its end of the socket 'fd'.
+ *
+*/
+void zygote_serve(int fd) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	zygote_reply_t reply;
+	buffer_t request = {NULL, 0, 0};
+	ssize_t num_bytes;
+	int fds[2];
+
+	while (1) {
+		// Size of the next request.
+		if ((num_bytes = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC)) <= 0) {
+			break;
+		}
+
+		request.len = 0;
+
+		if (buffer_reserve(&request, num_bytes + 1) != 0) {
+			break;
+		}
+
+		iov.iov_base = request.data;
+		iov.iov_len = request.size;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if ((num_bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+			break;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+
+		if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) ||
+			(size_t) num_bytes <= sizeof(zygote_request_t))
+		{
+			fprintf(stderr, "Zygote received malformed request.\n");
+			break;
+		}
+
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		// Terminate the last string, even if the request is malformed.
+		request.data[num_bytes] = '\0';
+		reply = zygote_launch(request.data, num_bytes, fds);
+		close(fds[0]);
+		close(fds[1]);
+
+		if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) {
+			break;
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Fork the zygote. It is done at startup, while the shell is small.
+ * Zygote keeps only stderr and its end of the socket.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int zygote_start() {
+	int fds[2];
+	int fd_null;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	switch ((pid = fork())) {
+		case -1:
+			perror("fork");
+			close(fds[0]);
+			close(fds[1]);
+			return -1;
+		case 0:
+			close(fds[0]);
+
+			// Don't keep shell's input and output open.
+			if ((fd_null = open("/dev/null", O_RDWR | O_CLOEXEC)) != -1) {
+				dup2(fd_null, STDIN_FILENO);
+				dup2(fd_null, STDOUT_FILENO);
+				close(fd_null);
+			}
+
+			zygote_serve(fds[1]);
+	}
+
+	close(fds[1]);
+	zygote_fd = fds[0];
+	zygote_pid = pid;
+
+	return 0;
+}
+
+/*
+ * Forget the zygote which stopped responding and reap it. Commands
+ * are forked by the shell itself from now on.
+ *
+*/
+void zygote_drop() {
+	close(zygote_fd);
+	zygote_fd = -1;
+	kill(zygote_pid, SIGKILL);
+	waitpid(zygote_pid, NULL, 0);
+	zygote_pid = -1;
+	launch_mode = LAUNCH_FORK;
+}
+
+/*
+ * Launch the command's executable 'path' by the zygote. Descriptors
+ * 'fd_in' and 'fd_out' are passed to it. Request too large for the
+ * socket is launched using fork instead.
+ * Returns pid of the new process on success; -1 otherwise
+ * with errno set to the cause of the failure.
+ *
+*/
+pid_t command_launch_zygote(command_t *command, const char *path, int fd_in, int fd_out) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	buffer_t *request = &zygote_request;
+	zygote_request_t header = {command->run_in_bg, zygote_chdir, 0, 0};
+	int fds[2] = {fd_in, fd_out};
+	zygote_reply_t reply;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t num_bytes;
+	char *cwd;
+
+	request->len = 0;
+
+	// Header is filled in once the strings are counted.
+	if (buffer_reserve(request, sizeof(header)) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	request->len = sizeof(header);
+
+	if (zygote_chdir) {
+		if ((cwd = getcwd(NULL, 0)) == NULL || buffer_append(request, cwd) != 0) {
+			free(cwd);
+			return -1;
+		}
+
+		free(cwd);
+	}
+
+	if (buffer_append(request, path) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (char **arg = command->args; *arg != NULL; arg++, header.argc++) {
+		if (buffer_append(request, *arg) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	// Environment may have changed since the zygote was forked.
+	for (char **var = environ; *var != NULL; var++, header.envc++) {
+		if (buffer_append(request, *var) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	memcpy(request->data, &header, sizeof(header));
+
+	iov.iov_base = request->data;
+	iov.iov_len = request->len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) == -1) {
+		if (errno == EPIPE || errno == ECONNRESET) {
+			zygote_drop();
+			return command_launch_fork(command, path, fd_in, fd_out);
+		}
+
+		if (errno == EMSGSIZE) {
+			return command_launch_fork(command, path, fd_in, fd_out);
+		}
+
+		return -1;
+	}
+
+	zygote_chdir = 0;
+
+	while ((num_bytes = recv(zygote_fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR);
+
+	// Zygote terminated meanwhile.
+	if (num_bytes != sizeof(reply)) {
+		zygote_drop();
+		return command_launch_fork(command, path, fd_in, fd_out);
+	}
+
+	if (reply.pid != -1 && reply.error != 0) {
+		waitpid(reply.pid, NULL, 0);
+		reply.pid = -1;
+	}
+
+	errno = reply.error;
+
+	return reply.pid;
+}
+
+/*
+ * Launch the command's executable 'path' in the configured way.
+ * Commands with their own scheduling are always forked.
+ * Returns pid of the new process on success; -1 otherwise
+ * with errno set to the cause of the failure.
+ *
+*/
+static inline pid_t command_launch(command_t *command, const char *path, int fd_in, int fd_out) {
+	// Only the forked child can set up all of the scheduling.
+	if (command->sched != NULL) {
+		return command_launch_fork(command, path, fd_in, fd_out);
+	}
+
+#ifdef SPAWN_CLOSEFROM
+	if (launch_mode == LAUNCH_SPAWN) {
+		return command_launch_spawn(command, path, fd_in, fd_out);
+	}
+#endif
+
+	if (launch_mode == LAUNCH_ZYGOTE) {
+		return command_launch_zygote(command, path, fd_in, fd_out);
+	}
+
+	return command_launch_fork(command, path, fd_in, fd_out);
+}
+
+/*
+ * Launch the executable 'path' of the command, which the kernel
+ * couldn't execute, as a script of the system shell, just as
+ * execvp() does.
+ * Returns pid of the new process; -1 on failure with errno set.
+ *
+*/
+pid_t command_launch_script(command_t *command, const char *path, int fd_in, int fd_out) {
+	command_t script = *command;
+	size_t argc;
+
+	for (argc = 0; command->args[argc] != NULL; argc++);
+
+	if ((script.args = arena_alloc(&run_arena, (argc + 2) * sizeof(char *))) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// Arguments of the script follow its path.
+	script.args[0] = (char *) SCRIPT_SHELL;
+	script.args[1] = (char *) path;
+	memcpy(&script.args[2], &command->args[1], argc * sizeof(char *));
+
+	return command_launch(&script, SCRIPT_SHELL, fd_in, fd_out);
+}
+
+/*
+ * Launch a new process for the stage of a pipeline, with its stdin
+ * and stdout replaced by 'fd_in' and 'fd_out'. If the stage's
+ * 'run_in_bg' is set to false, it becomes a foreground process.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int command_spawn(command_t *command, int fd_in, int fd_out) {
+	struct timespec started;
+	int64_t trace;
+	int slot, cpu = -1;
+	const char *path;
+	pid_t c_pid;
+
+	if ((path = path_lookup(command->args[0])) == NULL) {
+		fprintf(stderr, "Couldn't find command '%s'.\n", command->args[0]);
+		return -1;
+	}
+
+	// Last stage holds the pipeline's CPU.
+	if (command->next == NULL && command->sched != NULL) {
+		cpu = command->sched->cpu;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	trace = trace_begin();
+
+	// Cached executable may have been removed since it was found.
+	// Search the PATH once again in such case.
+	if ((c_pid = command_launch(command, path, fd_in, fd_out)) < 0 && errno == ENOENT &&
+		path != command->args[0])
+	{
+		path_cache_invalidate(command->args[0]);
+
+		if ((path = path_lookup(command->args[0])) != NULL) {
+			c_pid = command_launch(command, path, fd_in, fd_out);
+		} else {
+			errno = ENOENT;
+		}
+	}
+
+	if (c_pid < 0 && errno == ENOEXEC) {
+		c_pid = command_launch_script(command, path, fd_in, fd_out);
+	}
+
+	trace_end("launch", trace_pid, trace);
+
+	if (c_pid < 0 || (slot = process_track(c_pid)) == -1) {
+		if (c_pid < 0) {
+			fprintf(stderr, "Couldn't execute command '%s': %s\n", command->args[0], strerror(errno));
+		} else {
+			// Don't leave behind a process nobody waits for.
+			kill(c_pid, SIGKILL);
+			waitpid(c_pid, NULL, 0);
+		}
+
+		return -1;
+	}
+
+	jobs.slab[slot].cpu = cpu;
+	jobs.slab[slot].started = started;
+	jobs.slab[slot].timed = command->timed;
+	jobs.slab[slot].last_stage = command->next == NULL;
+
+	// Child's stdin is the shell's input, unless redirected.
+	if (fd_in == STDIN_FILENO && input.fd == STDIN_FILENO) {
+		jobs.slab[slot].shares_input = 1;
+		input_sharers++;
+	}
+
+	if (! command->run_in_bg) {
+		// Foreground process. Event loop won't execute next
+		// command until all of them terminate.
+		jobs.slab[slot].foreground = 1;
+		fg_processes++;
+	} else {
+		// Background process.
+		if (interactive) {
+			printf("[%d] Started\n", (int) c_pid);
+		}
+
+		if (jobs_max > 0) {
+			jobs_running++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Create a pipe connecting two stages of a pipeline. Its
+ * capacity is changed if requested.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int command_pipe(int fd_pipe[2]) {
+	if (pipe2(fd_pipe, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return -1;
+	}
+
+	if (pipe_size > 0 && fcntl(fd_pipe[1], F_SETPIPE_SZ, pipe_size) == -1) {
+		fprintf(stderr, "Couldn't resize pipe to %d bytes: %s\n", pipe_size, strerror(errno));
+	}
+
+	return 0;
+}
+
+/*
+ * Launch new processes for all stages of the command's pipeline
+ * at once. Stdout of each stage is connected to stdin of the next
+ * one by a pipe, unless redirected to or from a file. Stdout of
+ * the last stage is 'fd_stdout', unless redirected.
+ * Returns 0 on success; -1 if any of the stages failed.
+ *
+*/
+int command_fork(command_t *command, int fd_stdout) {
+	int fd_in = STDIN_FILENO, fd_out, fd_next;
+	int fd_pipe[2];
+	int result = 0, cpu = -1, last_spawned = 0;
+	command_t *stage;
+
+	// Explicit affinity of the command takes precedence.
+	if (jobs_pin && command->run_in_bg && (command->sched == NULL || ! command->sched->has_cpus)) {
+		cpu = sched_pin(command);
+	}
+
+	for (stage = command; stage != NULL; stage = stage->next) {
+		stage->run_in_bg = command->run_in_bg;
+		stage->timed = command->timed;
+		stage->sched = command->sched;
+		fd_out = stage->next == NULL ? fd_stdout : STDOUT_FILENO;
+		fd_next = STDIN_FILENO;
+
+		if (stage->next != NULL) {
+			if (command_pipe(fd_pipe) != 0) {
+				result = -1;
+				break;
+			}
+
+			fd_out = fd_pipe[1];
+			fd_next = fd_pipe[0];
+		}
+
+		// Redirections take precedence over the pipes.
+		if (stage->in != NULL || stage->here != NULL) {
+			if (fd_in != STDIN_FILENO) {
+				close(fd_in);
+			}
+
+			fd_in = command_redirect_in(stage);
+		}
+
+		if (stage->out != NULL) {
+			if (stage->next != NULL) {
+				close(fd_out);
+			}
+
+			fd_out = command_redirect_out(stage);
+		}
+
+		// Substitution may leave a stage without any arguments.
+		if (stage->args[0] == NULL) {
+			fprintf(stderr, "Missing command in pipeline.\n");
+		}
+
+		// Neighbours of a failed stage just see the pipes closed.
+		if (fd_in == -1 || fd_out == -1 || stage->args[0] == NULL || command_spawn(stage, fd_in, fd_out) != 0) {
+			result = -1;
+		} else if (stage->next == NULL) {
+			last_spawned = 1;
+		}
+
+		// Redirections are owned by the child now.
+		if (fd_out != fd_stdout && fd_out != -1) {
+			close(fd_out);
+		}
+
+		if (fd_in != STDIN_FILENO && fd_in != -1) {
+			close(fd_in);
+		}
+
+		fd_in = fd_next;
+	}
+
+	if (fd_in != STDIN_FILENO) {
+		close(fd_in);
+	}
+
+	// Otherwise the CPU is released once the last stage terminates.
+	if (cpu != -1 && ! last_spawned) {
+		CPU_CLR(cpu, &jobs_cpus_used);
+	}
+
+	return result;
+}
+
+/*
+ * Handles built-in 'exit' command. Sends SIGKILL to any
+ * running background process and frees the table used to
+ * track them. In the parallel mode, running commands are
+ * waited for instead.
+ *
+*/
+int command_exit_handler(command_t *command) {
+	while (jobs_running > 0) {
+		events_wait(0, -1);
+	}
+
+	jobs_notify();
+
+	for (int slot = 0; slot < jobs.size; slot++) {
+		if (jobs.slab[slot].pid == 0) {
+			continue;
+		}
+
+		if (jobs.slab[slot].running) {
+			pidfd_send_signal(jobs.slab[slot].pidfd, SIGKILL, NULL, 0);
+		}
+
+		process_free(slot);
+	}
+
+	jobs.finished_head = jobs.finished_tail = -1;
+	// Stop the event loop.
+	interrupt = 1;
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'hash' command. Without arguments, prints
+ * executables resolved from the PATH. Option '-r' forgets all
+ * of them, any other argument is resolved and remembered.
+ *
+*/
+int command_hash_handler(command_t *command) {
+	path_entry_t *entry;
+	int status = 0;
+
+	if (command->args[1] == NULL) {
+		printf("hits\tcommand\n");
+
+		for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+			for (entry = path_cache[i]; entry != NULL; entry = entry->next) {
+				printf("%4u\t%s\n", entry->hits, entry->path);
+			}
+		}
+
+		return 0;
+	}
+
+	for (int i = 1; command->args[i] != NULL; i++) {
+		if (strcmp(command->args[i], "-r") == 0) {
+			path_cache_clear();
+		} else if (path_lookup(command->args[i]) == NULL) {
+			fprintf(stderr, "Couldn't find command '%s'.\n", command->args[i]);
+			status = 1;
+		}
+	}
+
+	return status;
+}
+
+/*
+ * Handles built-in 'time' command without arguments. Prints
+ * resource usage of the shell itself and of all its reaped
+ * children. Prefix of a command is handled by 'command_run'.
+ *
+*/
+int command_time_handler(command_t *command) {
+	static const char *who[] = {"shell", "children"};
+	static const int targets[] = {RUSAGE_SELF, RUSAGE_CHILDREN};
+	struct rusage usage;
+
+	for (int i = 0; i < 2; i++) {
+		if (getrusage(targets[i], &usage) == -1) {
+			perror("getrusage");
+			return 1;
+		}
+
+		printf("%s\tuser %ld.%03lds sys %ld.%03lds maxrss %ldk csw %ld/%ld\n", who[i],
+			(long) usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec / 1000,
+			(long) usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec / 1000,
+			usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+	}
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'cache' command, which prints how many lines
+ * were found among the parsed ones and how many had to be parsed.
+ *
+*/
+int command_cache_handler(command_t *command) {
+	int entries = 0;
+
+	for (int i = 0; i < PARSE_CACHE_SIZE; i++) {
+		entries += parse_cache[i].text != NULL;
+	}
+
+	printf("hits %lu misses %lu entries %d\n", parse_cache_hits, parse_cache_misses, entries);
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'cd' command. Changes the working directory
+ * to the given one, or to the HOME without arguments.
+ *
+*/
+int command_cd_handler(command_t *command) {
+	const char *dir = command->args[1];
+	char *cwd;
+
+	if (dir == NULL && (dir = getenv("HOME")) == NULL) {
+		fprintf(stderr, "Couldn't change directory, HOME isn't set.\n");
+		return 1;
+	}
+
+	if (chdir(dir) == -1) {
+		fprintf(stderr, "Couldn't change directory to '%s'.\n", dir);
+		return 1;
+	}
+
+	if ((cwd = getcwd(NULL, 0)) != NULL) {
+		setenv("PWD", cwd, 1);
+		free(cwd);
+	}
+
+	path_cache_forget_relative();
+	zygote_chdir = 1;
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'pwd' command.
+ *
+*/
+int command_pwd_handler(command_t *command) {
+	char *cwd;
+
+	if ((cwd = getcwd(NULL, 0)) == NULL) {
+		perror("getcwd");
+		return 1;
+	}
+
+	printf("%s\n", cwd);
+	free(cwd);
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'echo' command. Prints its arguments separated
+ * by spaces, followed by a new line unless the first one is '-n'.
+ *
+*/
+int command_echo_handler(command_t *command) {
+	char **args = command->args + 1;
+	int newline = 1;
+
+	if (args[0] != NULL && strcmp(args[0], "-n") == 0) {
+		newline = 0;
+		args++;
+	}
+
+	for (int i = 0; args[i] != NULL; i++) {
+		if (i > 0) {
+			putchar(' ');
+		}
+
+		fputs(args[i], stdout);
+	}
+
+	if (newline) {
+		putchar('\n');
+	}
+
+	return 0;
+}
+
+/*
+ * Handles built-in 'true' command.
+ *
+*/
+int command_true_handler(command_t *command) {
+	return 0;
+}
+
+/*
+ * Handles built-in 'false' command.
+ *
+*/
+int command_false_handler(command_t *command) {
+	return 1;
+}
+
+/*
+ * Parse an integer operand of the 'test' command.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int test_integer(const char *str, long *value) {
+	char *end;
+
+	errno = 0;
+	*value = strtol(str, &end, 10);
+
+	if (errno != 0 || end == str || *end != '\0') {
+		fprintf(stderr, "Integer expected instead of '%s'.\n", str);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Evaluate unary expression 'op arg' of the 'test' command.
+ * Returns 1 if it is true, 0 if it is false; -1 on failure.
+ *
+*/
+int test_unary(const char *op, const char *arg) {
+	struct stat st;
+
+	if (strcmp(op, "-n") == 0) {
+		return arg[0] != '\0';
+	} else if (strcmp(op, "-z") == 0) {
+		return arg[0] == '\0';
+	} else if (strcmp(op, "-r") == 0) {
+		return access(arg, R_OK) == 0;
+	} else if (strcmp(op, "-w") == 0) {
+		return access(arg, W_OK) == 0;
+	} else if (strcmp(op, "-x") == 0) {
+		return access(arg, X_OK) == 0;
+	} else if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("edfs", op[1]) == NULL) {
+		fprintf(stderr, "Unknown operator '%s'.\n", op);
+		return -1;
+	}
+
+	if (stat(arg, &st) == -1) {
+		return 0;
+	}
+
+	switch (op[1]) {
+		case 'd':
+			return S_ISDIR(st.st_mode);
+		case 'f':
+			return S_ISREG(st.st_mode);
+		case 's':
+			return st.st_size > 0;
+		default:
+			return 1;
+	}
+}
+
+/*
+ * Evaluate binary expression 'left op right' of the 'test' command.
+ * Returns 1 if it is true, 0 if it is false; -1 on failure.
+ *
+*/
+int test_binary(const char *left, const char *op, const char *right) {
+	static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+	long x, y;
+	int i;
+
+	if (strcmp(op, "=") == 0) {
+		return strcmp(left, right) == 0;
+	} else if (strcmp(op, "!=") == 0) {
+		return strcmp(left, right) != 0;
+	}
+
+	for (i = 0; i < 6 && strcmp(op, ops[i]) != 0; i++);
+
+	if (i == 6) {
+		fprintf(stderr, "Unknown operator '%s'.\n", op);
+		return -1;
+	}
+
+	if (test_integer(left, &x) != 0 || test_integer(right, &y) != 0) {
+		return -1;
+	}
+
+	switch (i) {
+		case 0:
+			return x == y;
+		case 1:
+			return x != y;
+		case 2:
+			return x < y;
+		case 3:
+			return x <= y;
+		case 4:
+			return x > y;
+		default:
+			return x >= y;
+	}
+}
+
+/*
+ * Handles built-in 'test' command, also called '['. Supports
+ * a single string, unary operators on strings and files, string
+ * and integer comparisons, each optionally negated by '!'.
+ *
+*/
+int command_test_handler(command_t *command) {
+	char **args = command->args + 1;
+	int count = 0, negate = 0, result;
+
+	while (args[count] != NULL) {
+		count++;
+	}
+
+	if (strcmp(command->args[0], "[") == 0) {
+		if (count == 0 || strcmp(args[count - 1], "]") != 0) {
+			fprintf(stderr, "Missing ']'.\n");
+			return 2;
+		}
+
+		count--;
+	}
+
+	if (count > 0 && strcmp(args[0], "!") == 0) {
+		negate = 1;
+		args++;
+		count--;
+	}
+
+	switch (count) {
+		case 0:
+			result = 0;
+			break;
+		case 1:
+			result = args[0][0] != '\0';
+			break;
+		case 2:
+			result = test_unary(args[0], args[1]);
+			break;
+		case 3:
+			result = test_binary(args[0], args[1], args[2]);
+			break;
+		default:
+			fprintf(stderr, "Too many arguments of '%s'.\n", command->args[0]);
+			result = -1;
+	}
+
+	if (result == -1) {
+		return 2;
+	}
+
+	return result != negate ? 0 : 1;
+}
+
+/*
+ * Built-in commands, placed by the 'builtin_hash' of their name.
+ * The hash was chosen to be collision-free for these names, so
+ * a lookup is a single string comparison.
+ *
+*/
+static const builtin_t builtins[BUILTINS_SIZE] = {
+	[1] = {"pwd", command_pwd_handler},
+	[2] = {"test", command_test_handler},
+	[3] = {"echo", command_echo_handler},
+	[5] = {"false", command_false_handler},
+	[6] = {"cache", command_cache_handler},
+	[8] = {"[", command_test_handler},
+	[9] = {"cd", command_cd_handler},
+	[10] = {"time", command_time_handler},
+	[12] = {"true", command_true_handler},
+	[13] = {"exit", command_exit_handler},
+	[14] = {"hash", command_hash_handler},
+};
+
+/*
+ * Perfect hash of the built-in commands' names. Second character
+ * of a single-character name is its terminating null.
+ *
+*/
+static inline unsigned builtin_hash(const char *name, size_t len) {
+	return (5 * (unsigned char) name[0] + 2 * (unsigned char) name[1] + len) % BUILTINS_SIZE;
+}
+
+/*
+ * Find the built-in command 'name'.
+ * Returns the command; NULL if there is no such built-in.
+ *
+*/
+const builtin_t *builtin_find(const char *name) {
+	// No built-in name is longer.
+	size_t len = strnlen(name, 6);
+	const builtin_t *builtin;
+
+	if (len == 0 || len > 5) {
+		return NULL;
+	}
+
+	builtin = &builtins[builtin_hash(name, len)];
+
+	if (builtin->name == NULL || strcmp(builtin->name, name) != 0) {
+		return NULL;
+	}
+
+	return builtin;
+}
+
+/*
+ * Replace the shell's descriptor 'target' by 'fd' for the time
+ * a built-in command runs. The original one is kept in 'saved'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int builtin_redirect(int fd, int target, int *saved) {
+	if (fd == target) {
+		*saved = -1;
+		return 0;
+	}
+
+	if ((*saved = fcntl(target, F_DUPFD_CLOEXEC, 0)) == -1) {
+		perror("fcntl");
+		close(fd);
+		return -1;
+	}
+
+	if (dup2(fd, target) == -1) {
+		perror("dup2");
+		close(*saved);
+		*saved = -1;
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * Put back the shell's descriptor 'target' saved by 'builtin_redirect'.
+ *
+*/
+void builtin_restore(int target, int saved) {
+	if (saved != -1) {
+		dup2(saved, target);
+		close(saved);
+	}
+}
+
+/*
+ * Execute the built-in command in the shell's process. Its
+ * redirections are done by temporarily replacing shell's own
+ * stdin and stdout.
+ * Returns exit status of the command.
+ *
+*/
+int builtin_run(const builtin_t *builtin, command_t *command) {
+	int fd_in, fd_out, saved_in, saved_out;
+	int status;
+
+	if ((fd_out = command_redirect_out(command)) == -1) {
+		return 1;
+	}
+
+	if ((fd_in = command_redirect_in(command)) == -1) {
+		if (fd_out != STDOUT_FILENO) {
+			close(fd_out);
+		}
+
+		return 1;
+	}
+
+	// Data buffered so far belong to the original stdout.
+	fflush(stdout);
+
+	if (builtin_redirect(fd_out, STDOUT_FILENO, &saved_out) != 0) {
+		if (fd_in != STDIN_FILENO) {
+			close(fd_in);
+		}
+
+		return 1;
+	}
+
+	if (builtin_redirect(fd_in, STDIN_FILENO, &saved_in) != 0) {
+		builtin_restore(STDOUT_FILENO, saved_out);
+		return 1;
+	}
+
+	status = builtin->handler(command);
+
+	// There is no prompt to flush the output in non-interactive mode.
+	fflush(stdout);
+	builtin_restore(STDOUT_FILENO, saved_out);
+	builtin_restore(STDIN_FILENO, saved_in);
+
+	return status;
+}
+
+/*
+ * Check whether the command only moves data from a file, being
+ * just redirections or 'cat' without arguments. Such command is
+ * executed by the shell itself, unless it should run concurrently.
+ *
+*/
+static inline int command_copies(command_t *command) {
+	if (command->args[0] == NULL) {
+		return command->next == NULL;
+	}
+
+	return command->next == NULL && ! command->run_in_bg && jobs_max == 0 &&
+		(command->in != NULL || command->here != NULL) &&
+		strcmp(command->args[0], CMD_CAT) == 0 && command->args[1] == NULL;
+}
+
+/*
+ * Check whether SIGINT arrived. It is consumed, it's meant for
+ * the copy only, not for the command running next.
+ *
+*/
+static inline int copy_interrupted() {
+	static const struct timespec now = {0, 0};
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+
+	if (sigtimedwait(&mask, NULL, &now) != SIGINT) {
+		return 0;
+	}
+
+	printf("\n");
+
+	return 1;
+}
+
+/*
+ * Copy all remaining data from 'fd_in' to 'fd_out' in chunks,
+ * stopping early on SIGINT. Data don't pass through userspace
+ * if the kernel can avoid it: copy_file_range between files,
+ * sendfile from a file, splice to or from a pipe. Each one is
+ * tried in turn until some is supported for the descriptors;
+ * read and write are the last resort.
+ * Returns 0 on success; 1 if interrupted; -1 otherwise.
+ *
+*/
+int copy_data(int fd_in, int fd_out) {
+	static char buffer[READ_SIZE];
+	ssize_t num_bytes, written;
+
+	while ((num_bytes = copy_file_range(fd_in, NULL, fd_out, NULL, COPY_SIZE, 0)) > 0) {
+		if (copy_interrupted()) {
+			return 1;
+		}
+	}
+
+	if (num_bytes == 0) {
+		return 0;
+	}
+
+	if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("copy_file_range");
+		return -1;
+	}
+
+	while ((num_bytes = sendfile(fd_out, fd_in, NULL, COPY_SIZE)) > 0) {
+		if (copy_interrupted()) {
+			return 1;
+		}
+	}
+
+	if (num_bytes == 0) {
+		return 0;
+	}
+
+	if (errno != EINVAL && errno != ENOSYS) {
+		perror("sendfile");
+		return -1;
+	}
+
+	while ((num_bytes = splice(fd_in, NULL, fd_out, NULL, COPY_SIZE, SPLICE_F_MOVE)) > 0) {
+		if (copy_interrupted()) {
+			return 1;
+		}
+	}
+
+	if (num_bytes == 0) {
+		return 0;
+	}
+
+	if (errno != EINVAL) {
+		perror("splice");
+		return -1;
+	}
+
+	while ((num_bytes = read(fd_in, buffer, sizeof(buffer))) > 0) {
+		for (ssize_t pos = 0; pos < num_bytes; pos += written) {
+			if ((written = write(fd_out, buffer + pos, num_bytes - pos)) == -1) {
+				perror("write");
+				return -1;
+			}
+		}
+
+		if (copy_interrupted()) {
+			return 1;
+		}
+	}
+
+	if (num_bytes == -1) {
+		perror("read");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Execute the command only moving data from a file, as checked by
+ * 'command_copies', without launching a process. Files are opened
+ * just like for a launched command. Without an input file, the
+ * output file is only created.
+ * Returns exit status of the command.
+ *
+*/
+int command_copy(command_t *command) {
+	int fd_in, fd_out;
+	int status = 0;
+
+	if ((fd_out = command_redirect_out(command)) == -1) {
+		return 1;
+	}
+
+	if (command->in != NULL || command->here != NULL) {
+		if ((fd_in = command_redirect_in(command)) == -1) {
+			status = 1;
+		} else {
+			// Data buffered so far precede the copied ones.
+			fflush(stdout);
+
+			// Interrupted copy fails just like a process killed by SIGINT.
+			if ((status = copy_data(fd_in, fd_out)) != 0) {
+				status = status == 1 ? 128 + SIGINT : 1;
+			}
+
+			close(fd_in);
+		}
+	}
+
+	if (fd_out != STDOUT_FILENO) {
+		close(fd_out);
+	}
+
+	return status;
+}
+
+/*
+ * Execute the substituted command with its stdout connected to
+ * a pipe and read all of its output into 'substitution_output'.
+ * Its processes are waited for before returning.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int substitution_capture(command_t *command) {
+	buffer_t *output = &substitution_output;
+	ssize_t num_bytes;
+	int fd_pipe[2];
+
+	output->len = 0;
+
+	if (command->args[0] == NULL) {
+		return 0;
+	}
+
+	if (pipe2(fd_pipe, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return -1;
+	}
+
+	command_fork(command, fd_pipe[1]);
+	close(fd_pipe[1]);
+
+	// Read until all the processes close the pipe.
+	while (1) {
+		if (buffer_reserve(output, READ_SIZE) != 0) {
+			break;
+		}
+
+		if ((num_bytes = read(fd_pipe[0], output->data + output->len, output->size - output->len)) <= 0) {
+			if (num_bytes == -1 && errno == EINTR) {
+				continue;
+			}
+
+			if (num_bytes == -1) {
+				perror("read");
+			}
+
+			break;
+		}
+
+		output->len += num_bytes;
+	}
+
+	close(fd_pipe[0]);
+
+	// Shell runs no other foreground process meanwhile.
+	while (fg_processes > 0) {
+		events_wait(0, -1);
+	}
+
+	return 0;
+}
+
+/*
+ * Append 'arg' to the array of arguments 'args' of size 'size'
+ * with 'pos' used entries. Array is grown in the 'arena' when
+ * there would be no room left for the terminating NULL.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int args_push(arena_t *arena, char ***args, size_t *size, size_t *pos, char *arg) {
+	char **new_args;
+
+	(*args)[(*pos)++] = arg;
+
+	if (*pos + 1 >= *size) {
+		// Previous array is left in the arena, it's freed with it.
+		if ((new_args = arena_alloc(arena, 2 * *size * sizeof(char *))) == NULL) {
+			return -1;
+		}
+
+		memcpy(new_args, *args, *pos * sizeof(char *));
+		*args = new_args;
+		*size <<= 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Replace substituted arguments of every stage of the command by
+ * output of their commands, split into words at white space.
+ * New arrays of arguments are allocated from 'run_arena'.
+ * Returns 0 on success; -1 otherwise.
+ *
+*/
+int command_expand(command_t *command) {
+	buffer_t *output = &substitution_output;
+	arena_t *arena = &run_arena;
+	size_t args_size, pos, start, end;
+	substitution_t *subst;
+	char **args;
+	char *word;
+
+	for (command_t *stage = command; stage != NULL; stage = stage->next) {
+		if ((subst = stage->substitutions) == NULL) {
+			continue;
+		}
+
+		args_size = ARGS_SIZE;
+		pos = 0;
+
+		if ((args = arena_alloc(arena, args_size * sizeof(char *))) == NULL) {
+			return -1;
+		}
+
+		for (size_t i = 0; stage->args[i] != NULL; i++) {
+			if (subst == NULL || subst->pos != i) {
+				if (args_push(arena, &args, &args_size, &pos, stage->args[i]) != 0) {
+					return -1;
+				}
+
+				continue;
+			}
+
+			// Substitutions of the substituted command come first.
+			if (command_expand(subst->command) != 0 || substitution_capture(subst->command) != 0) {
+				return -1;
+			}
+
+			subst = subst->next;
 
-	command->run_in_bg = 0;
-	// These just point to the 'buffer', no freeing needed.
-	command->args = NULL;
-	command->out = NULL;
-	command->in = NULL;
-}
+			for (end = 0; ; ) {
+				for (start = end; start < output->len && isspace((unsigned char) output->data[start]); start++);
 
-/*
- * Represents a process executing user's command.
- *
-*/
-typedef struct process_t {
-	// Simple linked list.
-	struct process_t *next;
-	// True if the process is still running.
-	// This is set to false when SIGCHLD is handled.
-	int running;
-	// Pid of the process.
-	pid_t pid;
-} process_t;
+				if (start == output->len) {
+					break;
+				}
 
-static inline void process_free(process_t *process) {
-	free(process);
-}
+				for (end = start; end < output->len && ! isspace((unsigned char) output->data[end]); end++);
 
-static const char *CMD_EXIT = "exit";
-static const char *PROMPT = "$ ";
+				if ((word = arena_alloc(arena, end - start + 1)) == NULL) {
+					return -1;
+				}
 
-static const char RUN_IN_BG = '&';
-static const char REDIR_OUT = '>';
-static const char REDIR_IN = '<';
+				memcpy(word, output->data + start, end - start);
+				word[end - start] = '\0';
 
-static volatile sig_atomic_t interrupt = 0;
-static volatile pid_t fg_pid = -1;
+				if (args_push(arena, &args, &args_size, &pos, word) != 0) {
+					return -1;
+				}
+			}
+		}
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-static process_t *bg_head = NULL;
+		args[pos] = NULL;
+		stage->args = args;
+		stage->substitutions = NULL;
+	}
 
-static char buffer[BUFFER_SIZE];
-static int new_command = 0;
+	return 0;
+}
 
 /*
- * Display shell's prompt. If there are any terminated background
- * processes, notification for each one is printed before the
- * prompt itself. Notifications aren't printed in any particular order.
+ * Handles built-in 'sched' command prefixing another command, which
+ * sets up scheduling of the command's process. Options are removed
+ * from the command's arguments:
+ *   -c CPUS    affinity, list such as '0-3,8'
+ *   -n NICE    nice value
+ *   -p POLICY  policy 'other', 'batch', 'idle', 'fifo:PRIO' or 'rr:PRIO'
+ *   -i CLASS   I/O priority 'rt', 'be' or 'idle', optionally ':LEVEL'
+ * Returns 0 on success; -1 otherwise.
  *
 */
-void prompt_show() {
-	process_t *curr_process = bg_head;
-	process_t *prev_process = NULL;
-	process_t *old_process;
+int command_sched(command_t *command) {
+	char **args = command->args + 1;
+	sched_t *sched;
+	char *end;
+	int error;
 
-	// Print notifications about finished background processes.
-	while (curr_process != NULL) {
-		if (! curr_process->running) {
-			printf("[%d] Finished\n", curr_process->pid);
-			old_process = curr_process;
-
-			// Remove the information from the list.
-			if (prev_process == NULL) {
-				bg_head = curr_process = curr_process->next;
-			} else {
-				prev_process->next = curr_process->next;
-				curr_process = curr_process->next;
-			}
+	if ((sched = arena_alloc(&run_arena, sizeof(sched_t))) == NULL) {
+		return -1;
+	}
 
-			process_free(old_process);
-			continue;
+	sched->has_cpus = 0;
+	sched->has_nice = 0;
+	sched->policy = -1;
+	sched->ioprio = -1;
+	sched->cpu = -1;
+
+	for (; args[0] != NULL && args[0][0] == '-'; args += 2) {
+		if (args[0][1] == '\0' || args[0][2] != '\0' || strchr("cnpi", args[0][1]) == NULL || args[1] == NULL) {
+			fprintf(stderr, "Usage: sched [-c cpus] [-n nice] [-p policy] [-i class] command\n");
+			return -1;
+		}
+
+		switch (args[0][1]) {
+			case 'c':
+				error = sched_parse_cpus(args[1], &sched->cpus);
+				sched->has_cpus = 1;
+				break;
+			case 'n':
+				sched->nice = strtol(args[1], &end, 10);
+				error = *end != '\0' || end == args[1] ? -1 : 0;
+				sched->has_nice = 1;
+				break;
+			case 'p':
+				error = sched_parse_policy(args[1], sched);
+				break;
+			case 'i':
+				error = sched_parse_ioprio(args[1], sched);
+				break;
+			default:
+				error = -1;
+		}
+
+		if (error != 0) {
+			fprintf(stderr, "Invalid value '%s' of option '%s'.\n", args[1], args[0]);
+			return -1;
 		}
+	}
 
-		prev_process = curr_process;
-		curr_process = curr_process->next;
+	if (args[0] == NULL) {
+		fprintf(stderr, "Missing command of '%s'.\n", CMD_SCHED);
+		return -1;
 	}
 
-	printf("%s", PROMPT);
-	fflush(stdout);
+	command->args = args;
+	command->sched = sched;
+
+	return 0;
 }
 
 /*
- * Parse an user's command stored in the 'buffer'. Arguments
- * and other information is stored in the 'command'.
- * Parsing is done in-situ in the 'buffer'.
- * Returns 0 on success; -1 otherwise.
- *
- * WARNING: Modifies contents of the 'buffer'!
+ * Executes a parsed command, if there is any.
  *
 */
-int command_parse(command_t *command) {
-	size_t args_size = ARGS_SIZE;
-	char token = '\0';
-	int ignore = 0;
-	int pos = 0;
+void command_run(command_t *command) {
+	const builtin_t *builtin;
+	struct timespec started;
+	struct rusage usage;
+	int64_t trace;
+	int copies;
 
-	if ((command->args = malloc(args_size * sizeof(char *))) == NULL) {
-		perror("malloc");
-		return -1;
+	// Check if some command was actually parsed. We need at least
+	// a name of the program to execute or a redirection.
+	if (command->args == NULL || command_empty(command)) {
+		return;
 	}
 
-	command->run_in_bg = 0;
-	command->out = NULL;
-	command->in = NULL;
+	// Status of anything which fails before running.
+	last_status = 1;
 
-	for (int i = 0; i < EFFECTIVE_BUFFER_SIZE; i++) {
-		if (isspace(buffer[i]) || buffer[i] == '\0') {
-			// Preemptive string termination.
-			buffer[i] = '\0';
-			ignore = 0;
-			continue;
+	for (command_t *stage = command; command->next != NULL && stage != NULL; stage = stage->next) {
+		if (stage->args[0] == NULL) {
+			fprintf(stderr, "Missing command in pipeline.\n");
+			return;
 		}
+	}
 
-		if (buffer[i] == RUN_IN_BG || buffer[i] == REDIR_OUT || buffer[i] == REDIR_IN) {
-			if (buffer[i] == RUN_IN_BG) {
-				command->run_in_bg = 1;
+	while (command->args[0] != NULL) {
+		if (strcmp(command->args[0], CMD_TIME) == 0 && command->args[1] != NULL) {
+			// Built-in time command followed by another command, whose
+			// resource usage is reported once it terminates.
+			command->args++;
+			command->timed = 1;
+		} else if (strcmp(command->args[0], CMD_SCHED) == 0) {
+			// Built-in sched command followed by another command.
+			if (command_sched(command) != 0) {
+				return;
 			}
-
-			// Store the token and terminate previous argument.
-			token = buffer[i];
-			buffer[i] = '\0';
-			ignore = 0;
-			continue;
+		} else {
+			break;
 		}
+	}
 
-		// Argument's beginning. Just store pointer to the buffer.
-		if (! ignore) {
-			if (token == REDIR_IN) {
-				command->in = &buffer[i];
-			} else if (token == REDIR_OUT) {
-				command->out = &buffer[i];
-			} else {
-				command->args[pos++] = &buffer[i];
-			}
+	// Only exit is executed, so the shell can terminate.
+	if (noexec) {
+		last_status = 0;
 
-			// Just read the rest of the argument.
-			ignore = 1;
+		if (command->next == NULL && command->args[0] != NULL && strcmp(command->args[0], CMD_EXIT) == 0) {
+			command_exit_handler(command);
 		}
 
-		if (args_size <= pos) {
-			args_size <<= 1;
+		return;
+	}
 
-			if ((command->args = realloc(command->args, args_size * sizeof(char *))) == NULL) {
-				perror("realloc");
-				return -1;
+	trace = trace_begin();
+
+	if (command_expand(command) != 0) {
+		return;
+	}
+
+	trace_end("expand", trace_pid, trace);
+
+	// Stages of a pipeline run concurrently, even built-in ones
+	// are executed as separate processes. So are background ones.
+	copies = command_copies(command);
+	builtin = ! copies && command->next == NULL && ! command->run_in_bg ? builtin_find(command->args[0]) : NULL;
+
+	if (copies || builtin != NULL) {
+		// Usage of the shell itself covers the command.
+		if (command->timed) {
+			clock_gettime(CLOCK_MONOTONIC, &started);
+
+			if (getrusage(RUSAGE_SELF, &usage) == -1) {
+				perror("getrusage");
+				command->timed = 0;
 			}
 		}
+
+		trace = trace_begin();
+
+		if (copies) {
+			last_status = command_copy(command);
+			trace_end("copy", trace_pid, trace);
+		} else {
+			last_status = builtin_run(builtin, command);
+			trace_end("builtin", trace_pid, trace);
+		}
+
+		if (command->timed) {
+			shell_usage(stderr, &started, &usage);
+		}
+
+		return;
 	}
 
-	// NULL-terminate arguments.
-	while (pos < args_size) {
-		command->args[pos++] = NULL;
+	// Every command runs in background in the parallel mode, except
+	// for those followed by another command of the list. Event loop
+	// makes sure there is a free slot.
+	if (jobs_max > 0 && command->list_next == NULL) {
+		command->run_in_bg = 1;
 	}
 
-	return 0;
+	// Status of a foreground pipeline is known once its last stage
+	// terminates. Background one succeeds right away.
+	if (command_fork(command, STDOUT_FILENO) == 0 || command->run_in_bg) {
+		last_status = 0;
+	}
 }
 
 /*
- * Redirect command's stdout to the requested file.
- * Exits on failure.
+ * Executes the list of commands one by one. Each of them runs once
+ * the previous one terminates and only if the previous exit status
+ * allows it: after '&&' if it's zero, after '||' if it isn't. Status
+ * of a skipped command is the one of the previous command.
+ * Interrupted command ends the whole list.
  *
 */
-void command_redirect_out(command_t *command) {
-	static mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-	static int flags = O_WRONLY | O_TRUNC | O_CREAT;
-	int fd;
+void command_list(command_t *command) {
+	char op;
 
-	if (command->out != NULL) {
-		if ((fd = open(command->out, flags, mode)) == -1) {
-			fprintf(stderr, "Couldn't open file '%s'.\n", command->out);
-			exit(EXIT_FAILURE);
+	while (command != NULL) {
+		command_run(command);
+
+		if (command->list_next == NULL) {
+			break;
 		}
 
-		if (dup2(fd, STDOUT_FILENO) == -1) {
-			perror("dup2");
-			close(fd);
-			exit(EXIT_FAILURE);
+		// Next command waits just as the next line would.
+		while (! interrupt && (fg_processes > 0 || (jobs_max > 0 && jobs_running >= jobs_max))) {
+			events_wait(0, -1);
 		}
 
-		close(fd);
+		if (interrupt || last_status == 128 + SIGINT) {
+			break;
+		}
+
+		op = command->list_op;
+		command = command->list_next;
+
+		while (command != NULL && ((op == LIST_AND && last_status != 0) || (op == LIST_OR && last_status == 0))) {
+			op = command->list_op;
+			command = command->list_next;
+		}
 	}
 }
 
 /*
- * Redirect command's stdin to the requested file.
- * Exits on failure.
+ * Hash of the 'text' of length 'len'. It is taken 32 bytes at
+ * once, in four independent lanes.
  *
 */
-void command_redirect_in(command_t *command) {
-	int fd;
+static inline uint64_t parse_cache_hash(const char *text, size_t len) {
+	const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+	uint64_t lanes[4] = {len, 1, 2, 3};
+	uint64_t word, hash = 0;
+	size_t i = 0;
 
-	if (command->in != NULL) {
-		if ((fd = open(command->in, O_RDONLY)) == -1) {
-			fprintf(stderr, "Couldn't open file '%s'.\n", command->in);
-			exit(EXIT_FAILURE);
+	for (; i + sizeof(lanes) <= len; i += sizeof(lanes)) {
+		for (int lane = 0; lane < 4; lane++) {
+			memcpy(&word, text + i + lane * sizeof(word), sizeof(word));
+			lanes[lane] = (lanes[lane] ^ word) * prime;
 		}
+	}
 
-		if (dup2(fd, STDIN_FILENO) == -1) {
-			perror("dup2");
-			close(fd);
-			exit(EXIT_FAILURE);
-		}
+	for (; i < len; i += sizeof(word)) {
+		word = 0;
+		memcpy(&word, text + i, len - i < sizeof(word) ? len - i : sizeof(word));
+		lanes[0] = (lanes[0] ^ word) * prime;
+	}
 
-		close(fd);
+	for (int lane = 0; lane < 4; lane++) {
+		hash = (hash ^ lanes[lane] ^ (lanes[lane] >> 32)) * prime;
 	}
+
+	return hash ^ (hash >> 32);
 }
 
 /*
- * Fork a new process for the command. Will wait for the process
- * to terminate if the command's 'run_in_bg' is set to false.
+ * Copy the parsed 'command', with all its stages and commands of
+ * its list, whose strings point into 'text', to the 'copy', whose
+ * strings point to the same positions of the 'copy_text'. Memory
+ * is allocated from the 'arena'.
  * Returns 0 on success; -1 otherwise.
  *
 */
-int command_fork(command_t *command) {
-	pid_t c_pid, w_pid;
-	int status;
+int command_relocate(command_t *copy, const command_t *command, const char *text, char *copy_text, arena_t *arena) {
+	const command_t *element = command;
+	command_t *stage = copy;
+	size_t argc;
 
-	if ((c_pid = fork()) < 0) {
-		perror("fork");
-		return -1;
-	}
-
-	// Parent process
-	if (c_pid > 0) {
-		if (! command->run_in_bg) {
-			// Foreground process.
-			fg_pid = c_pid;
-
-			// Wait for the foreground process to terminate.
-			do {
-				if ((w_pid = waitpid(c_pid, &status, 0)) == -1) {
-					// Since SIGCHLD is handled by the main thread,
-					// there is a race between this and the main thread
-					// to receive the child's return code.
-					//
-					// If the signal handler is executed first, waitpid
-					// fails with ECHILD which we'll ignore.
-					//
-					// Either way, we end up with terminated foreground
-					// process and 'fg_pid' set to -1.
-					if (errno != ECHILD) {
-						perror("waitpid");
-						fg_pid = -1;
-						return -1;
-					}
+	while (1) {
+		*stage = *command;
+		stage->next = NULL;
+		stage->list_next = NULL;
 
-					break;
-				}
-			} while(! (WIFEXITED(status) || WIFSIGNALED(status)));
+		for (argc = 0; command->args[argc] != NULL; argc++);
 
-			fg_pid = -1;
-		} else {
-			// Background process.
-			process_t *process;
+		if ((stage->args = arena_alloc(arena, (argc + 1) * sizeof(char *))) == NULL) {
+			return -1;
+		}
 
-			if ((process = malloc(sizeof(process_t))) == NULL) {
-				perror("malloc");
-				return -1;
-			}
+		for (size_t i = 0; i < argc; i++) {
+			stage->args[i] = copy_text + (command->args[i] - text);
+		}
 
-			printf("[%d] Started\n", (int) c_pid);
+		stage->args[argc] = NULL;
 
-			process->next = NULL;
-			process->pid = c_pid;
-			process->running = 1;
+		if (command->in != NULL) {
+			stage->in = copy_text + (command->in - text);
+		}
 
-			// Store the basic information about the running process.
-			if (bg_head == NULL) {
-				bg_head = process;
-			} else {
-				process->next = bg_head;
-				bg_head = process;
-			}
+		if (command->out != NULL) {
+			stage->out = copy_text + (command->out - text);
 		}
-	}
 
-	// Child process.
-	if (c_pid == 0) {
-		sigset_t mask;
+		if (command->next != NULL) {
+			// Next stage of the pipeline.
+			command = command->next;
 
-		// Redirect process' stdout and stdin, if requested by the command.
-		command_redirect_out(command);
-		command_redirect_in(command);
-		sigemptyset(&mask);
+			if ((stage->next = arena_alloc(arena, sizeof(command_t))) == NULL) {
+				return -1;
+			}
 
-		// Background commands ignore SIGINT sent to the foreground one.
-		if (command->run_in_bg) {
-			sigaddset(&mask, SIGINT);
-		}
+			stage = stage->next;
+		} else if (element->list_next != NULL) {
+			// Next command of the list.
+			command = element = element->list_next;
 
-		// Unblock all signals blocked by the command handling thread.
-		pthread_sigmask(SIG_SETMASK, &mask, NULL);
+			if ((copy->list_next = arena_alloc(arena, sizeof(command_t))) == NULL) {
+				return -1;
+			}
 
-		// Will return only when error occurred.
-		execvp(command->args[0], command->args);
-		perror("execvp");
-		exit(EXIT_FAILURE);
+			stage = copy = copy->list_next;
+		} else {
+			return 0;
+		}
 	}
+}
 
-	return 0;
+/*
+ * Check whether the parsed command can be kept in the cache. Data
+ * of here-documents and here-strings aren't part of the parsed
+ * text, substitutions have commands of their own.
+ *
+*/
+static inline int parse_cache_fits(const command_t *command) {
+	for (; command != NULL; command = command->list_next) {
+		for (const command_t *stage = command; stage != NULL; stage = stage->next) {
+			if (stage->here != NULL || stage->substitutions != NULL) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
 }
 
 /*
- * Handles built-in 'exit' command. Sends SIGKILL to any
- * running background process and frees the list used to
- * track them.
+ * Parse the command stored in the 'line' just like command_parse(),
+ * unless the same line was parsed recently. Then the parsed text is
+ * copied over the line and the command is copied from the cache.
+ * Least recently used line is replaced by the parsed one, if it was
+ * seen before.
+ * Returns 0 on success; -1 otherwise.
  *
 */
-void command_exit_handler() {
-	process_t *curr_process = bg_head;
-	process_t *old_process;
+int command_parse_cached(command_t *command, arena_t *arena) {
+	uint64_t hash = parse_cache_hash(line, line_len);
+	parse_entry_t *entry;
+	int slot = 0;
+
+	for (int i = 0; i < PARSE_CACHE_SIZE; i++) {
+		entry = &parse_cache[i];
+
+		if (parse_cache_hashes[i] == hash && entry->text != NULL && entry->len == line_len &&
+			memcmp(entry->text, line, line_len) == 0)
+		{
+			entry->used = ++parse_cache_hits + parse_cache_misses;
+			memcpy(line, entry->tokens, line_len);
+
+			if (command_relocate(command, &entry->command, entry->tokens, line, arena) != 0) {
+				command->next = NULL;
+				return -1;
+			}
 
-	while (curr_process != NULL) {
-		if (curr_process->running) {
-			kill(curr_process->pid, SIGKILL);
+			return 0;
 		}
 
-		old_process = curr_process;
-		curr_process = old_process->next;
-		old_process->next = NULL;
+		// Unused entry is the oldest one.
+		if (entry->used < parse_cache[slot].used) {
+			slot = i;
+		}
+	}
 
-		free(old_process);
+	parse_cache_misses++;
+
+	if (parse_cache_seen[hash % PARSE_CACHE_SIZE] != hash) {
+		parse_cache_seen[hash % PARSE_CACHE_SIZE] = hash;
+		return command_parse(command, arena);
 	}
 
-	bg_head = NULL;
-	// Stop the running threads.
-	interrupt = 1;
+	// Line is parsed in place, its text is needed afterwards.
+	if (buffer_reserve(&parse_cache_key, line_len) != 0) {
+		return command_parse(command, arena);
+	}
+
+	memcpy(parse_cache_key.data, line, line_len);
+
+	if (command_parse(command, arena) != 0) {
+		return -1;
+	}
+
+	if (! parse_cache_fits(command)) {
+		return 0;
+	}
+
+	entry = &parse_cache[slot];
+	entry->text = NULL;
+	entry->used = 0;
+	arena_reset(&entry->arena);
+
+	if ((entry->text = arena_alloc(&entry->arena, line_len)) == NULL ||
+		(entry->tokens = arena_alloc(&entry->arena, line_len)) == NULL ||
+		command_relocate(&entry->command, command, line, entry->tokens, &entry->arena) != 0)
+	{
+		entry->text = NULL;
+		return 0;
+	}
+
+	memcpy(entry->text, parse_cache_key.data, line_len);
+	memcpy(entry->tokens, line, line_len);
+	entry->len = line_len;
+	entry->used = parse_cache_hits + parse_cache_misses;
+	parse_cache_hashes[slot] = hash;
+
+	return 0;
 }
 
 /*
- * Executes a command stored in the 'buffer', if there is any.
+ * Executes a command stored in the 'line', if there is any.
  * Returns 0 on success; -1 otherwise.
  *
 */
 int command_execute() {
+	int64_t trace = trace_begin();
 	command_t command;
 
 	// Try to parse a command.
-	if (command_parse(&command) != 0) {
+	if (command_parse_cached(&command, &command_arena) != 0) {
 		command_clear(&command);
+		arena_reset(&command_arena);
 		return -1;
 	}
 
-	// Check if some command was actually parsed.
-	// We need at least a name of the program to execute.
-	if (command.args == NULL || command.args[0] == NULL) {
-		command_clear(&command);
-		return 0;
-	}
-
-	// Built-in exit command.
-	if (strcmp(command.args[0], CMD_EXIT) == 0) {
-		command_clear(&command);
-		command_exit_handler();
-		return 0;
-	}
-
-	command_fork(&command);
+	trace_end("parse", trace_pid, trace);
+	trace = trace_begin();
+	command_list(&command);
+	trace_end("run", trace_pid, trace);
 	command_clear(&command);
+	arena_reset(&command_arena);
+	arena_reset(&run_arena);
 
 	return 0;
 }
 
 /*
- * Thread handling user's commands. Each command is parsed
- * and executed. Once a command is successfully executed,
- * input handling thread is signaled.
+ * Parse complete lines, which were already read from the input,
+ * ahead into the typeahead queue until it is full. Lines are
+ * copied, the reader can move its buffer meanwhile, unless the
+ * whole input was read already. Line which can't be parsed is
+ * queued as well, its error is reported once it's reached.
  *
 */
-void *commands_handler() {
-	while (! interrupt) {
-		if (pthread_mutex_lock(&mutex) != 0) {
-			interrupt = 1;
-			perror("pthread_mutex_lock");
-			exit(EXIT_FAILURE);
-		}
+void typeahead_fill() {
+	typeahead_t *entry;
+	int64_t trace;
+	char *text;
+	size_t len;
+	int result;
 
-		while (! new_command) {
-			if (pthread_cond_wait(&cond, &mutex) != 0) {
-				interrupt = 1;
-				perror("pthread_cond_wait");
-				exit(EXIT_FAILURE);
-			}
+	while (typeahead_tail - typeahead_head < TYPEAHEAD_SIZE) {
+		if ((text = reader_line(&input, &len)) == NULL) {
+			return;
 		}
 
-		command_execute();
-		new_command = 0;
+		entry = &typeahead[typeahead_tail % TYPEAHEAD_SIZE];
 
-		// Signal the input handling thread.
-		if (pthread_cond_signal(&cond) != 0) {
-			interrupt = 1;
-			perror("pthread_cond_signal");
-			exit(EXIT_FAILURE);
+		if (input.eof) {
+			// Buffer isn't filled anymore, parse the line in place.
+			line = text;
+		} else if ((line = arena_alloc(&entry->arena, len + 1)) != NULL) {
+			memcpy(line, text, len + 1);
+		} else {
+			// Line is left for input_read(), not to lose the command.
+			reader_unread(&input, text, len);
+			return;
 		}
 
-		if (pthread_mutex_unlock(&mutex) != 0) {
-			interrupt = 1;
-			perror("pthread_mutex_lock");
-			exit(EXIT_FAILURE);
+		line_len = len;
+		entry->error[0] = '\0';
+		parse_error_buffer = entry->error;
+		trace = trace_begin();
+		result = command_parse_cached(&entry->command, &entry->arena);
+		parse_error_buffer = NULL;
+
+		if (result != 0) {
+			// Nothing is executed for the entry.
+			command_clear(&entry->command);
+			arena_reset(&entry->arena);
+		} else {
+			trace_end("parse", trace_pid, trace);
 		}
-	}
 
-	pthread_exit(NULL);
+		typeahead_tail++;
+	}
 }
 
 /*
- * Read user's input and store it in the 'buffer'.
- * Returns 0 on success; -1 otherwise.
+ * Executes the oldest command from the typeahead queue.
  *
 */
-int input_read() {
-	ssize_t num_bytes;
-
-	// Clear previous command to prevent unexpected leaking.
-	memset(buffer, '\0', sizeof(buffer));
-	num_bytes = read(STDIN_FILENO, &buffer, BUFFER_SIZE);
-
-	if (num_bytes < 0) {
-		perror("read");
-		return -1;
-	}
+void typeahead_execute() {
+	typeahead_t *entry = &typeahead[typeahead_head++ % TYPEAHEAD_SIZE];
+	int64_t trace = trace_begin();
 
-	if (num_bytes > EFFECTIVE_BUFFER_SIZE) {
-		fprintf(stderr, "Input is too long. Maximum length is %d\n", EFFECTIVE_BUFFER_SIZE);
-
-		// Read rest of the line.
-		if (buffer[num_bytes - 1] != '\n') {
-			while (getchar() != '\n');
-		}
-
-		return -1;
-	}
-
-	if (num_bytes == 0) {
-		// Handle EOF just as if the user entered 'exit' command.
-		strcpy(buffer, CMD_EXIT);
-		printf("%s\n", buffer);
-	} else {
-		if (buffer[num_bytes - 1] == '\n') {
-			// Input was terminated with new line.
-			// Terminate the string by replacing the new line symbol.
-			buffer[num_bytes - 1] = '\0';
-		} else {
-			// Input was terminated by EOF.
-			// Terminate the string by appending '\0' to the line.
-			buffer[num_bytes] = '\0';
-			printf("\n");
-		}
+	if (entry->error[0] != '\0') {
+		fprintf(stderr, "%s", entry->error);
 	}
 
-	return 0;
+	command_list(&entry->command);
+	trace_end("run", trace_pid, trace);
+	command_clear(&entry->command);
+	arena_reset(&entry->arena);
+	arena_reset(&run_arena);
 }
 
 /*
- * Thread handling user's input. Input is stored in the 'buffer'.
- * Once a command is successfully read, command handling thread
- * is signaled.
+ * Event loop of the shell. Lines of the input are executed one
+ * by one, next line is taken only once the foreground process
+ * terminates (and there is a free slot in the parallel mode).
+ * Meanwhile, following lines are parsed ahead. They are also
+ * read ahead, unless a running process could read the input.
  *
 */
-void *input_handler() {
+void shell_loop() {
+	int prompt = 1;
+
 	while (! interrupt) {
-		if (pthread_mutex_lock(&mutex) != 0) {
-			interrupt = 1;
-			perror("pthread_mutex_lock");
-			exit(EXIT_FAILURE);
+		if (fg_processes > 0 || (jobs_max > 0 && jobs_running >= jobs_max)) {
+			typeahead_fill();
+			events_wait(input_sharers == 0 && typeahead_tail - typeahead_head < TYPEAHEAD_SIZE, -1);
+			continue;
 		}
 
-		prompt_show();
-
-		if (input_read() == 0) {
-			new_command = 1;
-
-			// Signal the command handling thread.
-			if (pthread_cond_signal(&cond) != 0) {
-				interrupt = 1;
-				perror("pthread_cond_signal");
-				exit(EXIT_FAILURE);
+		if (prompt) {
+			// Catch up with terminated background processes first.
+			if (jobs.count > 0) {
+				events_wait(0, 0);
 			}
 
-			// Wait until the command is processed.
-			while (new_command) {
-				if (pthread_cond_wait(&cond, &mutex) != 0) {
-					interrupt = 1;
-					perror("pthread_cond_wait");
-					exit(EXIT_FAILURE);
-				}
-			}
+			prompt_show();
+			prompt = 0;
 		}
 
-		if (pthread_mutex_unlock(&mutex) != 0) {
-			interrupt = 1;
-			perror("pthread_mutex_lock");
-			exit(EXIT_FAILURE);
+		if (typeahead_head != typeahead_tail) {
+			typeahead_execute();
+			prompt = 1;
+		} else if (input_read() == 0) {
+			command_execute();
+			prompt = 1;
+		} else if (input_polled) {
+			events_wait(1, -1);
+		} else {
+			reader_fill(&input);
 		}
 	}
-
-	pthread_exit(NULL);
 }
 
 /*
- * Handler for SIGCHLD and SIGINT signals.
+ * Print usage of the shell.
  *
 */
-void sig_handler(int sig_num) {
-	if (sig_num == SIGCHLD) {
-		process_t *process;
-		pid_t c_pid;
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-AFZnt] [-T trace] [-j jobs] [-p size] [-c command | -f script]\n", name);
+	fprintf(stderr, "  -A  pin parallel commands to distinct CPUs\n");
+	fprintf(stderr, "  -F  launch commands using plain fork() instead of posix_spawn()\n");
+	fprintf(stderr, "  -T  record phases of commands to the file 'trace'\n");
+	fprintf(stderr, "  -Z  launch commands from a zygote process forked at startup\n");
+	fprintf(stderr, "  -c  execute commands from the string 'command' and exit\n");
+	fprintf(stderr, "  -f  execute commands from the file 'script' and exit\n");
+	fprintf(stderr, "  -j  run commands in parallel, at most 'jobs' of them at once\n");
+	fprintf(stderr, "  -p  set capacity of pipes between commands to 'size' bytes\n");
+	fprintf(stderr, "  -n  only parse commands, don't execute them\n");
+	fprintf(stderr, "  -t  report resource usage of every background command\n");
+}
 
-		while ((c_pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-			if (c_pid == fg_pid) {
-				// No further action is required. See commands handler.
-				fg_pid = -1;
-			} else {
-				process = bg_head;
-
-				// Update process' state. Notification will be printed next
-				// time the prompt is displayed.
-				while (process != NULL) {
-					if (process->pid == c_pid) {
-						process->running = 0;
-						break;
-					}
+int main(int argc, char *argv[]) {
+	sigset_t sig_mask;
+	int opt;
 
-					process = process->next;
+#ifdef __SSE2__
+	word_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	while ((opt = getopt(argc, argv, "AFT:Zc:f:j:np:t")) != -1) {
+		switch (opt) {
+			case 'A':
+				jobs_pin = 1;
+				break;
+			case 'F':
+				launch_mode = LAUNCH_FORK;
+				break;
+			case 'T':
+				if (trace_open(optarg) != 0) {
+					exit(EXIT_FAILURE);
 				}
-			}
-		}
-	}
 
-	if (sig_num == SIGINT) {
-		printf("\n");
+				break;
+			case 'Z':
+				launch_mode = LAUNCH_ZYGOTE;
+				break;
+			case 'c':
+				reader_string(&input, optarg);
+				interactive = 0;
+				break;
+			case 'f':
+				if (reader_map(&input, optarg) != 0) {
+					exit(EXIT_FAILURE);
+				}
 
-		if (fg_pid != -1) {
-			// Pass it the foreground process. Shell keeps running.
-			kill(fg_pid, SIGINT);
-		} else {
-			// User is just playing with the keyboard.
-			prompt_show();
+				interactive = 0;
+				break;
+			case 'j':
+				if ((jobs_max = atoi(optarg)) <= 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			case 'n':
+				noexec = 1;
+				break;
+			case 'p':
+				if ((pipe_size = atoi(optarg)) <= 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			case 't':
+				jobs_timed = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
 		}
 	}
-}
 
-int main() {
-	struct sigaction sig_action;
-	pthread_t commands_thread;
-	pthread_t input_thread;
-	sigset_t sig_mask;
+	if (jobs_pin && (jobs_max == 0 || sched_getaffinity(0, sizeof(cpu_set_t), &jobs_cpus) == -1)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
 
-	// Block all signals. This will be inherited by both handler threads.
-	sigfillset(&sig_mask);
-	pthread_sigmask(SIG_BLOCK, &sig_mask, NULL);
+	sigemptyset(&sig_mask);
+	sigaddset(&sig_mask, SIGINT);
 
-	if (pthread_create(&commands_thread, NULL, &commands_handler, NULL) != 0 ||
-		pthread_create(&input_thread, NULL, &input_handler, NULL) != 0)
-	{
-		interrupt = 1;
-		perror("pthread_create");
+	// Signals are received only through the event loop.
+	if (sigprocmask(SIG_BLOCK, &sig_mask, NULL) == -1) {
+		perror("sigprocmask");
 		exit(EXIT_FAILURE);
 	}
 
-	// Setup signal handler for the main thread.
-	sigemptyset(&sig_action.sa_mask);
-	sigaddset(&sig_action.sa_mask, SIGCHLD);
-	sigaddset(&sig_action.sa_mask, SIGINT);
-	sig_action.sa_handler = sig_handler;
-	sig_action.sa_flags = 0;
-
-	if (sigaction(SIGCHLD, &sig_action, NULL) == -1 ||
-		sigaction(SIGINT, &sig_action, NULL) == -1)
-	{
-		interrupt = 1;
-		perror("sigaction");
+	// Zygote inherits the blocked SIGINT, but not the event loop.
+	if (launch_mode == LAUNCH_ZYGOTE && zygote_start() != 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_sigmask(SIG_UNBLOCK, &sig_mask, NULL);
+	if (events_init(&sig_mask) != 0) {
+		exit(EXIT_FAILURE);
+	}
 
-	// Wait for both handlers to finish.
-	pthread_join(commands_thread, NULL);
-	pthread_join(input_thread, NULL);
+	shell_loop();
+	trace_close();
 
 	exit(EXIT_SUCCESS);
 }